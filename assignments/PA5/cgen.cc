@@ -24,18 +24,33 @@
 
 #include "cgen.h"
 #include "cgen_gc.h"
+#include <algorithm>
+#include <atomic>
 #include <map>
+#include <sstream>
+#include <thread>
 #include <vector>
 
 extern void emit_string_constant(ostream &str, char *s);
 extern int cgen_debug;
+extern int cgen_jobs;
+extern int cgen_optimize;
+extern bool guard_free;
+extern int cgen_int_cache_low;
+extern int cgen_int_cache_high;
+extern Memmgr_Test cgen_Memmgr_Test;
 
 #define DISPATH_ABORT "_dispatch_abort"
 
 std::map<Symbol, Class_> class_map;
 std::vector<Class_> cls_ordered;
 
-int label_num = 0;
+// Dispatch sites emitted, those that call a method directly, and those
+// among them that check the class of the receiver first.  Classes are
+// coded in parallel, so these are only read once that is done.
+static std::atomic<int> dispatch_sites(0);
+static std::atomic<int> direct_dispatch_sites(0);
+static std::atomic<int> guarded_dispatch_sites(0);
 
 //
 // Three symbols from the semantic analyzer (semant.cc) are used.
@@ -143,6 +158,10 @@ void program_class::cgen(ostream &os)
   os << "# start of generated code\n";
 
   initialize_constants();
+  if (cgen_optimize)
+  {
+    optimize_program(classes);
+  }
   CgenClassTable *codegen_classtable = new CgenClassTable(classes, os);
 
   os << "\n# end of generated code\n";
@@ -255,6 +274,16 @@ static void emit_sll(char *dest, char *src1, int num, ostream &s)
   s << SLL << dest << " " << src1 << " " << num << endl;
 }
 
+static void emit_sra(char *dest, char *src1, int num, ostream &s)
+{
+  s << SRA << dest << " " << src1 << " " << num << endl;
+}
+
+static void emit_srl(char *dest, char *src1, int num, ostream &s)
+{
+  s << SRL << dest << " " << src1 << " " << num << endl;
+}
+
 static void emit_jalr(char *dest, ostream &s)
 {
   s << JALR << "\t" << dest << endl;
@@ -275,6 +304,35 @@ static void emit_gc_assign(ostream &s)
   s << JAL << "_GenGC_Assign" << endl;
 }
 
+//
+// Under -g, whether storing `value' into an object has to be followed by
+// emit_gc_assign, in case an old object now points to a young one.
+// Under -O the constants and the Bools of operators, which are not in
+// the heap, need not be.
+//
+static bool needs_gc_assign(Expression value)
+{
+  if (cgen_Memmgr != GC_GENGC)
+  {
+    return false;
+  }
+  return !cgen_optimize ||
+         !(dynamic_cast<int_const_class *>(value) || dynamic_cast<string_const_class *>(value) ||
+           dynamic_cast<bool_const_class *>(value) || dynamic_cast<lt_class *>(value) ||
+           dynamic_cast<leq_class *>(value) || dynamic_cast<eq_class *>(value) ||
+           dynamic_cast<comp_class *>(value) || dynamic_cast<isvoid_class *>(value));
+}
+
+//
+// Whether the code of a routine calls out, through the runtime or to a
+// method.  The calls of its abort stubs never return and do not count.
+//
+static bool calls_out(const std::string &code)
+{
+  return code.find(JAL) != std::string::npos || code.find(JALR) != std::string::npos ||
+         code.find(JUMP) != std::string::npos;
+}
+
 static void emit_disptable_ref(Symbol sym, ostream &s)
 {
   s << sym << DISPTAB_SUFFIX;
@@ -285,9 +343,9 @@ static void emit_init_ref(Symbol sym, ostream &s)
   s << sym << CLASSINIT_SUFFIX;
 }
 
-static void emit_label_ref(int l, ostream &s)
+static void emit_label_ref(const std::string &l, ostream &s)
 {
-  s << "label" << l;
+  s << l;
 }
 
 static void emit_protobj_ref(Symbol sym, ostream &s)
@@ -300,62 +358,62 @@ static void emit_method_ref(Symbol classname, Symbol methodname, ostream &s)
   s << classname << METHOD_SEP << methodname;
 }
 
-static void emit_label_def(int l, ostream &s)
+static void emit_label_def(const std::string &l, ostream &s)
 {
   emit_label_ref(l, s);
   s << ":" << endl;
 }
 
-static void emit_beqz(char *source, int label, ostream &s)
+static void emit_beqz(char *source, const std::string &label, ostream &s)
 {
   s << BEQZ << source << " ";
   emit_label_ref(label, s);
   s << endl;
 }
 
-static void emit_beq(char *src1, char *src2, int label, ostream &s)
+static void emit_beq(char *src1, char *src2, const std::string &label, ostream &s)
 {
   s << BEQ << src1 << " " << src2 << " ";
   emit_label_ref(label, s);
   s << endl;
 }
 
-static void emit_bne(char *src1, char *src2, int label, ostream &s)
+static void emit_bne(char *src1, char *src2, const std::string &label, ostream &s)
 {
   s << BNE << src1 << " " << src2 << " ";
   emit_label_ref(label, s);
   s << endl;
 }
 
-static void emit_bleq(char *src1, char *src2, int label, ostream &s)
+static void emit_bleq(char *src1, char *src2, const std::string &label, ostream &s)
 {
   s << BLEQ << src1 << " " << src2 << " ";
   emit_label_ref(label, s);
   s << endl;
 }
 
-static void emit_blt(char *src1, char *src2, int label, ostream &s)
+static void emit_blt(char *src1, char *src2, const std::string &label, ostream &s)
 {
   s << BLT << src1 << " " << src2 << " ";
   emit_label_ref(label, s);
   s << endl;
 }
 
-static void emit_blti(char *src1, int imm, int label, ostream &s)
+static void emit_blti(char *src1, int imm, const std::string &label, ostream &s)
 {
   s << BLT << src1 << " " << imm << " ";
   emit_label_ref(label, s);
   s << endl;
 }
 
-static void emit_bgti(char *src1, int imm, int label, ostream &s)
+static void emit_bgti(char *src1, int imm, const std::string &label, ostream &s)
 {
   s << BGT << src1 << " " << imm << " ";
   emit_label_ref(label, s);
   s << endl;
 }
 
-static void emit_branch(int l, ostream &s)
+static void emit_branch(const std::string &l, ostream &s)
 {
   s << BRANCH;
   emit_label_ref(l, s);
@@ -372,212 +430,927 @@ static void emit_push(char *reg, ostream &str)
 }
 
 //
-// Fetch the integer value in an Int object.
-// Emits code to fetch the integer value of the Integer object pointed
-// to by register source into the register dest
+// The register the slots of the routine being emitted are addressed from.
 //
-static void emit_fetch_int(char *dest, char *source, ostream &s)
+static char *frame_base(Environment &env)
 {
-  emit_load(dest, DEFAULT_OBJFIELDS, source, s);
+  return env.is_leaf() ? (char *)SP : (char *)FP;
 }
 
 //
-// Emits code to store the integer value contained in register source
-// into the Integer object pointed to by dest.
+// Under -O with the generational collector every frame has a stack map
+// word below RA.  It points at the offsets of the slots that hold machine
+// integers, or is 0 if none does, and the collector hides those slots
+// from its scan of the stack.  A routine without a frame never collects.
 //
-static void emit_store_int(char *source, char *dest, ostream &s)
+static bool has_stack_maps()
 {
-  emit_store(source, DEFAULT_OBJFIELDS, dest, s);
+  return cgen_optimize && cgen_Memmgr == GC_GENGC;
 }
 
-static void emit_test_collector(ostream &s)
+//
+// Set up the frame of a routine: the caller's FP, SELF and RA, then the
+// stack map word, if any, and the `saved' registers at negative offsets
+// from FP, which points at RA, then `nslots' slots.  A collector scans
+// the slots before they are first written, so they are cleared of what
+// earlier frames left there.
+//
+static void emit_frame_entry(const std::vector<char *> &saved, int nslots, ostream &s)
 {
-  emit_push(ACC, s);
-  emit_move(ACC, SP, s);  // stack end
-  emit_move(A1, ZERO, s); // allocate nothing
-  s << JAL << gc_collect_names[cgen_Memmgr] << endl;
-  emit_addiu(SP, SP, 4, s);
-  emit_load(ACC, 0, SP, s);
+  int nsaved = saved.size();
+  int nmap = has_stack_maps();
+  int size = 3 + nmap + nsaved + nslots;
+  emit_addiu(SP, SP, -4 * size, s);
+  emit_store(FP, size, SP, s);
+  emit_store(SELF, size - 1, SP, s);
+  emit_store(RA, size - 2, SP, s);
+  for (int i = 0; i < nsaved; i++)
+  {
+    emit_store(saved[i], nslots + 1 + i, SP, s);
+  }
+  emit_addiu(FP, SP, 4 * (nslots + 1 + nsaved + nmap), s);
+  if (cgen_Memmgr != GC_NOGC)
+  {
+    for (int i = 0; i < nslots; i++)
+    {
+      emit_store(ZERO, 1 + i, SP, s);
+    }
+  }
+  if (nmap)
+  {
+    emit_store(ZERO, -1, FP, s);
+  }
 }
 
-static void emit_gc_check(char *source, ostream &s)
+//
+// The word offset from FP of saved register `i' of `nsaved'.
+//
+static int saved_reg_offset(int i, int nsaved)
 {
-  if (source != (char *)A1)
-    emit_move(A1, source, s);
-  s << JAL << "_gc_check" << endl;
+  return i - nsaved - has_stack_maps();
 }
 
-///////////////////////////////////////////////////////////////////////////////
 //
-// coding strings, ints, and booleans
+// Tear down the frame set up by emit_frame_entry and pop the `nargs'
+// arguments of the routine.
 //
-// Cool has three kinds of constants: strings, ints, and booleans.
-// This section defines code generation for each type.
+static void emit_frame_exit(const std::vector<char *> &saved, int nargs, ostream &s)
+{
+  int nsaved = saved.size();
+  for (int i = 0; i < nsaved; i++)
+  {
+    emit_load(saved[i], saved_reg_offset(i, nsaved), FP, s);
+  }
+  emit_load(RA, 0, FP, s);
+  emit_load(SELF, 1, FP, s);
+  emit_addiu(SP, FP, 8 + 4 * nargs, s);
+  emit_load(FP, 2, FP, s);
+}
+
 //
-// All string constants are listed in the global "stringtable" and have
-// type StringEntry.  StringEntry methods are defined both for String
-// constant definitions and references.
+// Point the stack map word of the frame at the map of the raw slots now
+// in use.
 //
-// All integer constants are listed in the global "inttable" and have
-// type IntEntry.  IntEntry methods are defined for Int
-// constant definitions and references.
+static void emit_stack_map(ostream &s, Environment &env)
+{
+  std::vector<int> offsets = env.get_raw_slot_offsets();
+  if (offsets.empty())
+  {
+    emit_store(ZERO, -1, FP, s);
+    return;
+  }
+  emit_load_address(T4, (char *)env.get_stack_map(offsets).c_str(), s);
+  emit_store(T4, -1, FP, s);
+}
+
 //
-// Since there are only two Bool values, there is no need for a table.
-// The two booleans are represented by instances of the class BoolConst,
-// which defines the definition and reference methods for Bools.
+// Keep the machine integer in ACC in a slot of the frame for `name'.
+// Returns the word offset of the slot.
 //
-///////////////////////////////////////////////////////////////////////////////
+static int emit_push_raw(Symbol name, ostream &s, Environment &env)
+{
+  int offset = env.push_stack_symbol(name, true);
+  emit_store(ACC, offset, frame_base(env), s);
+  if (!env.is_leaf())
+  {
+    emit_stack_map(s, env);
+  }
+  return offset;
+}
 
 //
-// Strings
+// Give back the innermost slot, taken by emit_push_raw.  It is cleared,
+// as the collector scans it again once the map no longer has it.
 //
-void StringEntry::code_ref(ostream &s)
+static void emit_pop_raw(ostream &s, Environment &env)
 {
-  s << STRCONST_PREFIX << index;
+  if (!env.is_leaf())
+  {
+    emit_store(ZERO, env.get_top_slot_offset(), FP, s);
+  }
+  env.pop_stack_symbol();
+  if (!env.is_leaf())
+  {
+    emit_stack_map(s, env);
+  }
 }
 
 //
-// Emit code for a constant String.
-// You should fill in the code naming the dispatch table.
+// Emit the stack maps the routines coded with `env' point at, into the
+// data segment: the number of raw slots, then the offset in bytes of
+// each from FP.
 //
-
-void StringEntry::code_def(ostream &s, int stringclasstag)
+static void emit_stack_maps(ostream &s, Environment &env)
 {
-  IntEntryP lensym = inttable.add_int(len);
-
-  // Add -1 eye catcher
-  s << WORD << "-1" << endl;
-
-  code_ref(s);
-  s << LABEL                                                              // label
-    << WORD << stringclasstag << endl                                     // tag
-    << WORD << (DEFAULT_OBJFIELDS + STRING_SLOTS + (len + 4) / 4) << endl // size
-    << WORD;
-
-  /***** Add dispatch information for class String ******/
-
-  s << Str << DISPTAB_SUFFIX;
-
-  s << endl; // dispatch table
-  s << WORD;
-  lensym->code_ref(s);
-  s << endl;                    // string length
-  emit_string_constant(s, str); // ascii string
-  s << ALIGN;                   // align to word
+  for (auto &map : env.get_stack_maps())
+  {
+    emit_label_def(map.second, s);
+    s << WORD << map.first.size() << endl;
+    for (int offset : map.first)
+    {
+      s << WORD << offset * WORD_SIZE << endl;
+    }
+  }
 }
 
 //
-// StrTable::code_string
-// Generate a string object definition for every string constant in the
-// stringtable.
+// Keep the value in ACC while another expression is evaluated: in the
+// register allocated to `value', or in a slot of the frame.
 //
-void StrTable::code_string_table(ostream &s, int stringclasstag)
+static void emit_save_temp(tree_node *value, ostream &s, Environment &env)
 {
-  for (List<StringEntry> *l = tbl; l; l = l->tl())
-    l->hd()->code_def(s, stringclasstag);
+  char *reg = env.get_reg(value);
+  if (reg)
+  {
+    emit_move(reg, ACC, s);
+  }
+  else
+  {
+    emit_store(ACC, env.push_stack_symbol(No_type), frame_base(env), s);
+  }
 }
 
 //
-// Ints
+// Get back a value kept by emit_save_temp into `dest'.
 //
-void IntEntry::code_ref(ostream &s)
+static void emit_restore_temp(char *dest, tree_node *value, ostream &s, Environment &env)
 {
-  s << INTCONST_PREFIX << index;
+  char *reg = env.get_reg(value);
+  if (reg)
+  {
+    emit_move(dest, reg, s);
+  }
+  else
+  {
+    emit_load(dest, env.get_top_slot_offset(), frame_base(env), s);
+    env.pop_stack_symbol();
+  }
 }
 
 //
-// Emit code for a constant Integer.
-// You should fill in the code naming the dispatch table.
+// Fetch the integer value in an Int object.
+// Emits code to fetch the integer value of the Integer object pointed
+// to by register source into the register dest
 //
+static void emit_fetch_int(char *dest, char *source, ostream &s)
+{
+  emit_load(dest, DEFAULT_OBJFIELDS, source, s);
+}
 
-void IntEntry::code_def(ostream &s, int intclasstag)
+//
+// Emits code to store the integer value contained in register source
+// into the Integer object pointed to by dest.
+//
+static void emit_store_int(char *source, char *dest, ostream &s)
 {
-  // Add -1 eye catcher
-  s << WORD << "-1" << endl;
+  emit_store(source, DEFAULT_OBJFIELDS, dest, s);
+}
 
-  code_ref(s);
-  s << LABEL                                           // label
-    << WORD << intclasstag << endl                     // class tag
-    << WORD << (DEFAULT_OBJFIELDS + INT_SLOTS) << endl // object size
-    << WORD;
+///////////////////////////////////////////////////////////////////////////////
+//
+// Unboxed Ints and Bools
+//
+// An expression of type Int or Bool can be evaluated by code_value to
+// its machine integer (0 or 1 for a Bool) in ACC.  Arithmetic and
+// comparisons work on machine integers, and let bindings of type Int or
+// Bool hold them unless boxing their reads would create more objects
+// than it saves (see unbox_binding).  An object is only created where a
+// value escapes: stored in an attribute or formal, passed as an
+// argument, returned, or used as an Object.
+//
+// The generational collector must never take a machine integer for a
+// pointer, so under GenGC unboxed values are only kept in $t5-$t7, which
+// it does not scan.  Otherwise they may also be kept in the allocated
+// registers or on the stack.
+//
+///////////////////////////////////////////////////////////////////////////////
 
-  /***** Add dispatch information for class Int ******/
+static char *scratch_regs[] = {T5, T6, T7};
+static const int num_scratch_regs = sizeof(scratch_regs) / sizeof(scratch_regs[0]);
 
-  s << Int << DISPTAB_SUFFIX;
+static bool scratch_free(Environment &env)
+{
+  return env.get_scratch_used() < num_scratch_regs;
+}
 
-  s << endl;                // dispatch table
-  s << WORD << str << endl; // integer value
+static char *acquire_scratch(Environment &env)
+{
+  int n = env.get_scratch_used();
+  env.set_scratch_used(n + 1);
+  return scratch_regs[n];
+}
+
+static void release_scratch(Environment &env)
+{
+  env.set_scratch_used(env.get_scratch_used() - 1);
 }
 
+// The largest object, in words, that emit_allocate copies in place.
+#define INLINE_COPY_WORDS 16
+
 //
-// IntTable::code_string_table
-// Generate an Int object definition for every Int constant in the
-// inttable.
+// Leave a new copy of the prototype of `cls' in ACC, but for its last
+// `unset' words, which the caller fills in.  Under -O a small object is
+// carved off the heap in place and the prototype's words copied over,
+// eyecatcher included, and only when the heap is full does the runtime's
+// Object.copy get called, which may collect.  When the collector is
+// tested at every allocation, Object.copy is always called.
 //
-void IntTable::code_string_table(ostream &s, int intclasstag)
+static void emit_allocate(Symbol cls, int unset, ostream &s, Environment &env)
 {
-  for (List<IntEntry> *l = tbl; l; l = l->tl())
-    l->hd()->code_def(s, intclasstag);
+  int words = DEFAULT_OBJFIELDS + class_map.at(cls)->all_attrs.size();
+  std::string proto = std::string(cls->get_string()) + PROTOBJ_SUFFIX;
+  if (!cgen_optimize || cgen_Memmgr_Test == GC_TEST || words > INLINE_COPY_WORDS)
+  {
+    emit_load_address(ACC, (char *)proto.c_str(), s);
+    emit_jal("Object.copy", s);
+    return;
+  }
+
+  std::string label_fast = env.new_label();
+  std::string label_done = env.new_label();
+  int bytes = WORD_SIZE * (words + 1);
+  emit_addiu(HEAP_PTR, HEAP_PTR, bytes, s);
+  emit_blt(HEAP_PTR, HEAP_LIMIT, label_fast, s);
+  emit_addiu(HEAP_PTR, HEAP_PTR, -bytes, s);
+  emit_load_address(ACC, (char *)proto.c_str(), s);
+  emit_jal("Object.copy", s);
+  emit_branch(label_done, s);
+
+  emit_label_def(label_fast, s);
+  emit_addiu(ACC, HEAP_PTR, -WORD_SIZE * words, s);
+  emit_load_address(T1, (char *)proto.c_str(), s);
+  for (int i = -1; i < words - unset; i++)
+  {
+    emit_load(T2, i, T1, s);
+    emit_store(T2, i, ACC, s);
+  }
+  emit_label_def(label_done, s);
 }
 
 //
-// Bools
+// Under -O the Ints from cgen_int_cache_low to cgen_int_cache_high are
+// preboxed in a table at INTCACHE, which an Int in that range is boxed
+// to instead of a new object.  No code stores into an Int once it is
+// made, and `=' compares Ints by value, so they can be shared.
 //
-BoolConst::BoolConst(int i) : val(i) { assert(i == 0 || i == 1); }
-
-void BoolConst::code_ref(ostream &s) const
+static bool has_int_cache()
 {
-  s << BOOLCONST_PREFIX << val;
+  return cgen_optimize && cgen_int_cache_low <= cgen_int_cache_high;
 }
 
 //
-// Emit code for a constant Bool.
-// You should fill in the code naming the dispatch table.
+// Replace the machine integer in ACC by an object of class `type', which
+// is Int or Bool.
 //
-
-void BoolConst::code_def(ostream &s, int boolclasstag)
+static void emit_box(Symbol type, ostream &s, Environment &env)
 {
-  // Add -1 eye catcher
-  s << WORD << "-1" << endl;
-
-  code_ref(s);
-  s << LABEL                                            // label
-    << WORD << boolclasstag << endl                     // class tag
-    << WORD << (DEFAULT_OBJFIELDS + BOOL_SLOTS) << endl // object size
-    << WORD;
-
-  /***** Add dispatch information for class Bool ******/
-
-  s << Bool << DISPTAB_SUFFIX;
+  if (type == Bool)
+  {
+    std::string label_done = env.new_label();
+    emit_move(T1, ACC, s);
+    emit_load_bool(ACC, BoolConst(1), s);
+    emit_bne(T1, ZERO, label_done, s);
+    emit_load_bool(ACC, BoolConst(0), s);
+    emit_label_def(label_done, s);
+    return;
+  }
+  emit_move(T8, ACC, s);
+  if (!has_int_cache())
+  {
+    emit_allocate(Int, INT_SLOTS, s, env);
+    emit_store_int(T8, ACC, s);
+    return;
+  }
 
-  s << endl;                // dispatch table
-  s << WORD << val << endl; // value (0 or 1)
+  std::string label_new = env.new_label();
+  std::string label_done = env.new_label();
+  emit_blti(T8, cgen_int_cache_low, label_new, s);
+  emit_bgti(T8, cgen_int_cache_high, label_new, s);
+  // Each Int takes 5 words with its eyecatcher: (n - low) * (16 + 4).
+  emit_addiu(T1, T8, -cgen_int_cache_low, s);
+  emit_sll(T2, T1, 2, s);
+  emit_sll(T1, T1, 4, s);
+  emit_addu(T1, T1, T2, s);
+  emit_load_address(ACC, (char *)INTCACHE, s);
+  emit_addu(ACC, ACC, T1, s);
+  emit_branch(label_done, s);
+  emit_label_def(label_new, s);
+  emit_allocate(Int, INT_SLOTS, s, env);
+  emit_store_int(T8, ACC, s);
+  emit_label_def(label_done, s);
 }
 
-//////////////////////////////////////////////////////////////////////////////
 //
-//  CgenClassTable methods
+// Load true or false into `dest', as a Bool object if `boxed'.
 //
-//////////////////////////////////////////////////////////////////////////////
+static void emit_load_truth(char *dest, int val, bool boxed, ostream &s)
+{
+  if (boxed)
+  {
+    emit_load_bool(dest, BoolConst(val), s);
+  }
+  else
+  {
+    emit_load_imm(dest, val, s);
+  }
+}
 
-//***************************************************
 //
-//  Emit code to start the .data segment and to
-//  declare the global names.
+// Whether ACC is zero, as a Bool object if `boxed'.
 //
-//***************************************************
+static void emit_is_zero(bool boxed, ostream &s, Environment &env)
+{
+  std::string label_done = env.new_label();
+  emit_move(T1, ACC, s);
+  emit_load_truth(ACC, 1, boxed, s);
+  emit_beq(T1, ZERO, label_done, s);
+  emit_load_truth(ACC, 0, boxed, s);
+  emit_label_def(label_done, s);
+}
 
-void CgenClassTable::code_global_data()
+//
+// Evaluate `e' only for its effects, so an Int or Bool result need not
+// be boxed.
+//
+static void emit_effect(Expression e, ostream &s, Environment &env)
 {
-  Symbol main = idtable.lookup_string(MAINNAME);
-  Symbol string = idtable.lookup_string(STRINGNAME);
-  Symbol integer = idtable.lookup_string(INTNAME);
-  Symbol boolc = idtable.lookup_string(BOOLNAME);
+  bool unboxed = is_unboxed_type(e->get_type()) && !dynamic_cast<dispatch_class *>(e) &&
+                 !dynamic_cast<static_dispatch_class *>(e) &&
+                 !dynamic_cast<typcase_class *>(e) && !dynamic_cast<new__class *>(e);
+  if (auto a = dynamic_cast<assign_class *>(e))
+  {
+    // A store elsewhere than in an unboxed binding needs the object anyway.
+    char *reg;
+    bool to_unboxed = false;
+    env.lookup_local(a->name, &reg, &to_unboxed);
+    unboxed = unboxed && to_unboxed;
+  }
+  if (unboxed)
+  {
+    e->code_value(s, env);
+  }
+  else
+  {
+    e->code(s, env);
+  }
+}
 
-  str << "\t.data\n"
-      << ALIGN;
-  //
-  // The following global names must be defined first.
+//
+// Whether `e' is never void, so dispatching on it or casing on it needs
+// no check: self, new objects, Ints, Bools and Strings, let and case
+// bindings of such values that are not assigned to, and the results of
+// the basic methods that return their receiver or a copy of it.  The
+// bindings made within the expression being looked at are in `bound'.
+//
+static bool is_non_void(Expression e, Environment &env,
+                        std::vector<std::pair<Symbol, bool>> &bound)
+{
+  Symbol type = e->get_type();
+  if (type == Int || type == Bool || type == Str || dynamic_cast<new__class *>(e))
+  {
+    return true;
+  }
+  if (auto o = dynamic_cast<object_class *>(e))
+  {
+    for (auto it = bound.rbegin(); it != bound.rend(); it++)
+    {
+      if (it->first == o->name)
+      {
+        return it->second;
+      }
+    }
+    return o->name == self || env.is_non_void_local(o->name);
+  }
+  if (auto a = dynamic_cast<assign_class *>(e))
+  {
+    return is_non_void(a->expr, env, bound);
+  }
+  if (auto b = dynamic_cast<block_class *>(e))
+  {
+    return is_non_void(b->body->nth(b->body->len() - 1), env, bound);
+  }
+  if (auto c = dynamic_cast<cond_class *>(e))
+  {
+    return is_non_void(c->then_exp, env, bound) && is_non_void(c->else_exp, env, bound);
+  }
+  if (auto l = dynamic_cast<let_class *>(e))
+  {
+    bool init = l->identifier == self ||
+                (!l->init->is_empty() && is_non_void(l->init, env, bound) &&
+                 !is_assigned(l->identifier, l->body));
+    bound.push_back({l->identifier, init});
+    bool body = is_non_void(l->body, env, bound);
+    bound.pop_back();
+    return body;
+  }
+  if (auto t = dynamic_cast<typcase_class *>(e))
+  {
+    for (int i = t->cases->first(); t->cases->more(i); i = t->cases->next(i))
+    {
+      Case c = t->cases->nth(i);
+      bound.push_back({c->get_name(), !is_assigned(c->get_name(), c->get_expr())});
+      bool branch = is_non_void(c->get_expr(), env, bound);
+      bound.pop_back();
+      if (!branch)
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  Class_ impl = NULL;
+  Symbol name = NULL;
+  if (auto d = dynamic_cast<static_dispatch_class *>(e))
+  {
+    impl = find_method_impl(d->type_name, d->name, NULL);
+    name = d->name;
+  }
+  else if (auto d = dynamic_cast<dispatch_class *>(e))
+  {
+    Symbol receiver = d->expr->get_type();
+    impl = unique_method_impl(receiver == SELF_TYPE ? env.get_cls()->get_name() : receiver,
+                              d->name);
+    name = d->name;
+  }
+  return impl && is_basic_class(impl->get_name()) &&
+         (name == copy || name == out_string || name == out_int);
+}
+
+static bool is_non_void(Expression e, Environment &env)
+{
+  std::vector<std::pair<Symbol, bool>> bound;
+  return is_non_void(e, env, bound);
+}
+
+//
+// Call the runtime's `routine' with the file name and `line' if ACC is
+// void.  The call is made from a stub after the routine being emitted,
+// which the checks on the same line share, so a check that passes costs
+// one branch.
+//
+static void emit_abort_if_void(char *routine, int line, ostream &s, Environment &env)
+{
+  emit_beqz(ACC, env.get_abort_stub(routine, env.get_cls()->get_filename(), line), s);
+}
+
+static void emit_abort_stubs(ostream &s, Environment &env)
+{
+  for (auto &stub : env.get_abort_stubs())
+  {
+    emit_label_def(stub.label, s);
+    if (stub.filename)
+    {
+      emit_partial_load_address(ACC, s);
+      stringtable.lookup_string(stub.filename->get_string())->code_ref(s);
+      s << endl;
+      emit_load_imm(T1, stub.line, s);
+    }
+    emit_jal((char *)stub.routine.c_str(), s);
+  }
+  env.clear_abort_stubs();
+}
+
+//
+// Whether `e' is a constant or a variable that holds an object, which is
+// had without allocating.
+//
+static bool is_at_hand(Expression e, Environment &env)
+{
+  if (dynamic_cast<int_const_class *>(e) || dynamic_cast<bool_const_class *>(e))
+  {
+    return true;
+  }
+  auto o = dynamic_cast<object_class *>(e);
+  char *reg;
+  bool unboxed = false;
+  return o && !(env.lookup_local(o->name, &reg, &unboxed) && unboxed);
+}
+
+//
+// Leave the machine integers of the operands of `op' in T1 and T2.  The
+// first is kept in an unboxed temporary while the second is evaluated if
+// that runs no Cool code, in a raw slot if the frame has a stack map and
+// it is not an object at hand, and otherwise where emit_save_temp puts
+// it.
+// A constant or variable is loaded without disturbing T1.
+//
+static void emit_operand_values(Expression op, Expression e1, Expression e2,
+                                ostream &s, Environment &env)
+{
+  if (dynamic_cast<int_const_class *>(e2) || dynamic_cast<bool_const_class *>(e2) ||
+      dynamic_cast<object_class *>(e2))
+  {
+    e1->code_value(s, env);
+    emit_move(T1, ACC, s);
+    e2->code_value(s, env);
+    emit_move(T2, ACC, s);
+  }
+  else if (!may_call(e2) && scratch_free(env))
+  {
+    e1->code_value(s, env);
+    char *scratch = acquire_scratch(env);
+    emit_move(scratch, ACC, s);
+    e2->code_value(s, env);
+    emit_move(T2, ACC, s);
+    emit_move(T1, scratch, s);
+    release_scratch(env);
+  }
+  else if (has_stack_maps() && !is_at_hand(e1, env))
+  {
+    e1->code_value(s, env);
+    int offset = emit_push_raw(No_type, s, env);
+    e2->code_value(s, env);
+    emit_move(T2, ACC, s);
+    emit_load(T1, offset, frame_base(env), s);
+    emit_pop_raw(s, env);
+  }
+  else if (cgen_Memmgr == GC_GENGC)
+  {
+    e1->code(s, env);
+    emit_save_temp(op, s, env);
+    e2->code_value(s, env);
+    emit_move(T2, ACC, s);
+    emit_restore_temp(T1, op, s, env);
+    emit_fetch_int(T1, T1, s);
+  }
+  else
+  {
+    e1->code_value(s, env);
+    emit_save_temp(op, s, env);
+    e2->code_value(s, env);
+    emit_move(T2, ACC, s);
+    emit_restore_temp(T1, op, s, env);
+  }
+}
+
+typedef void (*branch_fn)(char *, char *, const std::string &, ostream &);
+
+//
+// Compare the operands of `op' with the branch `test' taken when true.
+//
+static void emit_comparison(Expression op, Expression e1, Expression e2, branch_fn test,
+                            bool boxed, ostream &s, Environment &env)
+{
+  emit_operand_values(op, e1, e2, s, env);
+  std::string label_done = env.new_label();
+  emit_load_truth(ACC, 1, boxed, s);
+  test(T1, T2, label_done, s);
+  emit_load_truth(ACC, 0, boxed, s);
+  emit_label_def(label_done, s);
+}
+
+//
+// Leave the objects that are the operands of `=' in T1 and T2.
+//
+static void emit_object_operands(eq_class *op, ostream &s, Environment &env)
+{
+  op->e1->code(s, env);
+  emit_save_temp(op, s, env);
+  op->e2->code(s, env);
+  emit_restore_temp(T1, op, s, env);
+  emit_move(T2, ACC, s);
+}
+
+//
+// Whether `=' on objects of the static types of `op' may have to compare
+// Strings, or Ints and Bools passed around as Objects, by value with the
+// runtime's equality_test.  Objects of any other class are equal only if
+// they are the same.
+//
+static bool may_compare_values(eq_class *op)
+{
+  auto may_be_basic = [](Symbol type) { return type == Object || type == Str; };
+  return may_be_basic(op->e1->get_type()) && may_be_basic(op->e2->get_type());
+}
+
+//
+// Branch to `label' if the Bool `pred' is `sense', and fall through
+// otherwise.  Comparisons of Ints and Bools, `not', `isvoid', `=' on
+// objects that are only compared by identity, and conditionals, blocks
+// and constants made of these branch on their operands, without making
+// a Bool.
+//
+static void emit_branch_on(Expression pred, bool sense, const std::string &label,
+                           ostream &s, Environment &env)
+{
+  if (auto x = dynamic_cast<comp_class *>(pred))
+  {
+    emit_branch_on(x->e1, !sense, label, s, env);
+  }
+  else if (auto x = dynamic_cast<bool_const_class *>(pred))
+  {
+    if (bool(x->val) == sense)
+    {
+      emit_branch(label, s);
+    }
+  }
+  else if (auto x = dynamic_cast<isvoid_class *>(pred))
+  {
+    x->e1->code(s, env);
+    (sense ? emit_beq : emit_bne)(ACC, ZERO, label, s);
+  }
+  else if (auto x = dynamic_cast<lt_class *>(pred))
+  {
+    emit_operand_values(x, x->e1, x->e2, s, env);
+    if (sense)
+      emit_blt(T1, T2, label, s);
+    else
+      emit_bleq(T2, T1, label, s);
+  }
+  else if (auto x = dynamic_cast<leq_class *>(pred))
+  {
+    emit_operand_values(x, x->e1, x->e2, s, env);
+    if (sense)
+      emit_bleq(T1, T2, label, s);
+    else
+      emit_blt(T2, T1, label, s);
+  }
+  else if (auto x = dynamic_cast<eq_class *>(pred))
+  {
+    if (is_unboxed_type(x->e1->get_type()))
+    {
+      emit_operand_values(x, x->e1, x->e2, s, env);
+    }
+    else if (!may_compare_values(x))
+    {
+      emit_object_operands(x, s, env);
+    }
+    else
+    {
+      x->code_value(s, env);
+      (sense ? emit_bne : emit_beq)(ACC, ZERO, label, s);
+      return;
+    }
+    (sense ? emit_beq : emit_bne)(T1, T2, label, s);
+  }
+  else if (auto x = dynamic_cast<cond_class *>(pred))
+  {
+    std::string label_false = env.new_label();
+    std::string label_end = env.new_label();
+    emit_branch_on(x->pred, false, label_false, s, env);
+    emit_branch_on(x->then_exp, sense, label, s, env);
+    emit_branch(label_end, s);
+    emit_label_def(label_false, s);
+    emit_branch_on(x->else_exp, sense, label, s, env);
+    emit_label_def(label_end, s);
+  }
+  else if (auto x = dynamic_cast<block_class *>(pred))
+  {
+    for (int i = x->body->first(); x->body->more(i); i = x->body->next(i))
+    {
+      if (x->body->more(x->body->next(i)))
+      {
+        emit_effect(x->body->nth(i), s, env);
+      }
+      else
+      {
+        emit_branch_on(x->body->nth(i), sense, label, s, env);
+      }
+    }
+  }
+  else
+  {
+    pred->code_value(s, env);
+    (sense ? emit_bne : emit_beq)(ACC, ZERO, label, s);
+  }
+}
+
+//
+// The machine integer of an Int or Bool object computed by code().
+//
+void Expression_class::code_value(ostream &s, Environment &env)
+{
+  code(s, env);
+  emit_fetch_int(ACC, ACC, s);
+}
+
+static void emit_test_collector(ostream &s)
+{
+  emit_push(ACC, s);
+  emit_move(ACC, SP, s);  // stack end
+  emit_move(A1, ZERO, s); // allocate nothing
+  s << JAL << gc_collect_names[cgen_Memmgr] << endl;
+  emit_addiu(SP, SP, 4, s);
+  emit_load(ACC, 0, SP, s);
+}
+
+static void emit_gc_check(char *source, ostream &s)
+{
+  if (source != (char *)A1)
+    emit_move(A1, source, s);
+  s << JAL << "_gc_check" << endl;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// coding strings, ints, and booleans
+//
+// Cool has three kinds of constants: strings, ints, and booleans.
+// This section defines code generation for each type.
+//
+// All string constants are listed in the global "stringtable" and have
+// type StringEntry.  StringEntry methods are defined both for String
+// constant definitions and references.
+//
+// All integer constants are listed in the global "inttable" and have
+// type IntEntry.  IntEntry methods are defined for Int
+// constant definitions and references.
+//
+// Since there are only two Bool values, there is no need for a table.
+// The two booleans are represented by instances of the class BoolConst,
+// which defines the definition and reference methods for Bools.
+//
+///////////////////////////////////////////////////////////////////////////////
+
+//
+// Strings
+//
+void StringEntry::code_ref(ostream &s)
+{
+  referenced = true;
+  s << STRCONST_PREFIX << index;
+}
+
+//
+// Emit code for a constant String.
+// You should fill in the code naming the dispatch table.
+//
+
+void StringEntry::code_def(ostream &s, int stringclasstag)
+{
+  IntEntryP lensym = inttable.add_int(len);
+
+  // Add -1 eye catcher
+  s << WORD << "-1" << endl;
+
+  code_ref(s);
+  s << LABEL                                                              // label
+    << WORD << stringclasstag << endl                                     // tag
+    << WORD << (DEFAULT_OBJFIELDS + STRING_SLOTS + (len + 4) / 4) << endl // size
+    << WORD;
+
+  /***** Add dispatch information for class String ******/
+
+  s << Str << DISPTAB_SUFFIX;
+
+  s << endl; // dispatch table
+  s << WORD;
+  lensym->code_ref(s);
+  s << endl;                    // string length
+  emit_string_constant(s, str); // ascii string
+  s << ALIGN;                   // align to word
+}
+
+//
+// StrTable::code_string
+// Generate a string object definition for every string constant in the
+// stringtable that the generated code refers to.
+//
+void StrTable::code_string_table(ostream &s, int stringclasstag)
+{
+  for (List<StringEntry> *l = tbl; l; l = l->tl())
+    if (l->hd()->referenced)
+      l->hd()->code_def(s, stringclasstag);
+}
+
+void StrTable::clear_references()
+{
+  for (List<StringEntry> *l = tbl; l; l = l->tl())
+    l->hd()->referenced = false;
+}
+
+//
+// Ints
+//
+void IntEntry::code_ref(ostream &s)
+{
+  referenced = true;
+  s << INTCONST_PREFIX << index;
+}
+
+//
+// Emit code for a constant Integer.
+// You should fill in the code naming the dispatch table.
+//
+
+void IntEntry::code_def(ostream &s, int intclasstag)
+{
+  // Add -1 eye catcher
+  s << WORD << "-1" << endl;
+
+  code_ref(s);
+  s << LABEL                                           // label
+    << WORD << intclasstag << endl                     // class tag
+    << WORD << (DEFAULT_OBJFIELDS + INT_SLOTS) << endl // object size
+    << WORD;
+
+  /***** Add dispatch information for class Int ******/
+
+  s << Int << DISPTAB_SUFFIX;
+
+  s << endl;                // dispatch table
+  s << WORD << str << endl; // integer value
+}
+
+//
+// IntTable::code_string_table
+// Generate an Int object definition for every Int constant in the
+// inttable that the generated code refers to.  Must run after the
+// string table, whose lengths are Int constants.
+//
+void IntTable::code_string_table(ostream &s, int intclasstag)
+{
+  for (List<IntEntry> *l = tbl; l; l = l->tl())
+    if (l->hd()->referenced)
+      l->hd()->code_def(s, intclasstag);
+}
+
+void IntTable::clear_references()
+{
+  for (List<IntEntry> *l = tbl; l; l = l->tl())
+    l->hd()->referenced = false;
+}
+
+//
+// Bools
+//
+BoolConst::BoolConst(int i) : val(i) { assert(i == 0 || i == 1); }
+
+void BoolConst::code_ref(ostream &s) const
+{
+  s << BOOLCONST_PREFIX << val;
+}
+
+//
+// Emit code for a constant Bool.
+// You should fill in the code naming the dispatch table.
+//
+
+void BoolConst::code_def(ostream &s, int boolclasstag)
+{
+  // Add -1 eye catcher
+  s << WORD << "-1" << endl;
+
+  code_ref(s);
+  s << LABEL                                            // label
+    << WORD << boolclasstag << endl                     // class tag
+    << WORD << (DEFAULT_OBJFIELDS + BOOL_SLOTS) << endl // object size
+    << WORD;
+
+  /***** Add dispatch information for class Bool ******/
+
+  s << Bool << DISPTAB_SUFFIX;
+
+  s << endl;                // dispatch table
+  s << WORD << val << endl; // value (0 or 1)
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//
+//  CgenClassTable methods
+//
+//////////////////////////////////////////////////////////////////////////////
+
+//***************************************************
+//
+//  Emit code to start the .data segment and to
+//  declare the global names.
+//
+//***************************************************
+
+void CgenClassTable::code_global_data()
+{
+  Symbol main = idtable.lookup_string(MAINNAME);
+  Symbol string = idtable.lookup_string(STRINGNAME);
+  Symbol integer = idtable.lookup_string(INTNAME);
+  Symbol boolc = idtable.lookup_string(BOOLNAME);
+
+  str << "\t.data\n"
+      << ALIGN;
+  //
+  // The following global names must be defined first.
   //
   str << GLOBAL << CLASSNAMETAB << endl;
   str << GLOBAL;
@@ -658,37 +1431,59 @@ void CgenClassTable::code_select_gc()
   str << GLOBAL << "_MemMgr_COLLECTOR" << endl;
   str << "_MemMgr_COLLECTOR:" << endl;
   str << WORD << gc_collect_names[cgen_Memmgr] << endl;
+  // Bit 0 asks for a collection at every allocation, and bit 1 says
+  // that the frames have stack maps.
   str << GLOBAL << "_MemMgr_TEST" << endl;
   str << "_MemMgr_TEST:" << endl;
-  str << WORD << (cgen_Memmgr_Test == GC_TEST) << endl;
+  str << WORD << ((cgen_Memmgr_Test == GC_TEST) | has_stack_maps() << 1) << endl;
 }
 
 //********************************************************
 //
-// Emit code to reserve space for and initialize all of
-// the constants.  Class names should have been added to
+// Emit code to reserve space for and initialize the
+// constants.  Class names should have been added to
 // the string table (in the supplied code, is is done
 // during the construction of the inheritance graph), and
 // code for emitting string constants as a side effect adds
 // the string's length to the integer table.  The constants
 // are emmitted by running through the stringtable and inttable
-// and producing code for each entry.
+// and producing code for each entry that was referenced, so
+// this must run after everything else has been coded.
 //
 //********************************************************
 
 void CgenClassTable::code_constants()
 {
-  //
-  // Add constants that are required by the code generator.
-  //
-  stringtable.add_string("");
-  inttable.add_string("0");
-
   stringtable.code_string_table(str, stringclasstag);
   inttable.code_string_table(str, intclasstag);
+  code_int_cache();
   code_bools(boolclasstag);
 }
 
+//
+// Emit the table of preboxed Ints that emit_box returns from, laid out
+// as Int constants are.
+//
+void CgenClassTable::code_int_cache()
+{
+  if (!has_int_cache())
+  {
+    return;
+  }
+  for (int n = cgen_int_cache_low; n <= cgen_int_cache_high; n++)
+  {
+    str << WORD << "-1" << endl;
+    if (n == cgen_int_cache_low)
+    {
+      str << INTCACHE << LABEL;
+    }
+    str << WORD << intclasstag << endl
+        << WORD << (DEFAULT_OBJFIELDS + INT_SLOTS) << endl
+        << WORD << Int << DISPTAB_SUFFIX << endl
+        << WORD << n << endl;
+  }
+}
+
 int get_class_tag(Symbol name)
 {
   for (int i = 0; i < int(cls_ordered.size()); i++)
@@ -722,6 +1517,7 @@ CgenClassTable::CgenClassTable(Classes classes, ostream &s) : nds(NULL), str(s)
 
   install_classes(classes);
   build_inheritance_tree();
+  build_feature_tables();
 
   code();
   exitscope();
@@ -964,11 +1760,11 @@ void CgenClassTable::code_class_obj_tab()
   }
 }
 
-void get_methods_recursively(Class_ cls, std::vector<std::pair<Class_, method_class *>> all_methods)
+void get_methods_recursively(Class_ cls, std::vector<std::pair<Class_, method_class *>> &all_methods)
 {
   if (cls->get_name() != Object)
   {
-    get_methods_recursively(class_map[cls->get_parent()], all_methods);
+    get_methods_recursively(class_map.at(cls->get_parent()), all_methods);
   }
 
   Features features = cls->get_features();
@@ -987,6 +1783,7 @@ void get_methods_recursively(Class_ cls, std::vector<std::pair<Class_, method_cl
       {
         name_already_exist = true;
         iter->first = cls;
+        iter->second = method;
       }
     }
     if (!name_already_exist)
@@ -1002,10 +1799,14 @@ void CgenClassTable::code_dispatch_tables()
   {
     Class_ cls = *iter;
     str << cls->get_name() << DISPTAB_SUFFIX << LABEL;
-    get_methods_recursively(cls, cls->all_methods);
 
     for (auto iter = cls->all_methods.begin(); iter != cls->all_methods.end(); iter++)
     {
+      if (dead_methods.count(std::make_pair(iter->first->get_name(), iter->second->get_name())))
+      {
+        str << WORD << EMPTYSLOT << endl;
+        continue;
+      }
       str << WORD << (iter->first)->get_name() << "." << (iter->second)->get_name() << endl;
     }
   }
@@ -1015,7 +1816,7 @@ void get_class_attrs_recusively(Class_ cls, std::vector<attr_class *> &attrs)
 {
   if (cls->get_name() != Object)
   {
-    get_class_attrs_recusively(class_map[cls->get_parent()], attrs);
+    get_class_attrs_recusively(class_map.at(cls->get_parent()), attrs);
   }
   Features features = cls->get_features();
   for (int i = features->first(); features->more(i); i = features->next(i))
@@ -1033,12 +1834,72 @@ void get_class_attrs_recusively(Class_ cls, std::vector<attr_class *> &attrs)
   }
 }
 
+//
+// Under -O an attribute initialized to a constant starts with it in the
+// prototype, and its initializer is not run, if nothing can see the
+// attribute before the initializer would: the initializers ahead of it,
+// in the class and its ancestors, make no calls and do not name it.
+//
+static bool is_prototype_constant(Class_ cls, attr_class *attr)
+{
+  Expression init = attr->get_init();
+  if (!cgen_optimize ||
+      !(dynamic_cast<int_const_class *>(init) || dynamic_cast<bool_const_class *>(init) ||
+        dynamic_cast<string_const_class *>(init)))
+  {
+    return false;
+  }
+  for (auto before : cls->all_attrs)
+  {
+    if (before == attr)
+    {
+      break;
+    }
+    Expression e = before->get_init();
+    if (!e->is_empty() && (may_call(e) || is_used(attr->get_name(), e)))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void code_constant_ref(Expression e, ostream &s)
+{
+  if (auto c = dynamic_cast<int_const_class *>(e))
+  {
+    inttable.lookup_string(c->token->get_string())->code_ref(s);
+  }
+  else if (auto c = dynamic_cast<string_const_class *>(e))
+  {
+    stringtable.lookup_string(c->token->get_string())->code_ref(s);
+  }
+  else
+  {
+    (((bool_const_class *)e)->val ? truebool : falsebool).code_ref(s);
+  }
+}
+
+//
+// Whether a new object of class `cls' has initializers left to run once
+// it is copied from the prototype.
+//
+static bool has_initializers(Class_ cls)
+{
+  for (auto attr : cls->all_attrs)
+  {
+    if (!attr->get_init()->is_empty() && !is_prototype_constant(cls, attr))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
 void CgenClassTable::code_prototypes()
 {
   for (auto iter = cls_ordered.begin(); iter != cls_ordered.end(); iter++)
   {
-    get_class_attrs_recusively(*iter, (*iter)->all_attrs);
-
     Class_ cls = *iter;
 
     str << WORD << "-1" << endl;
@@ -1051,7 +1912,11 @@ void CgenClassTable::code_prototypes()
     {
       Symbol type = attr->get_type_decl();
       str << WORD;
-      if (type == Int)
+      if (is_prototype_constant(cls, attr))
+      {
+        code_constant_ref(attr->get_init(), str);
+      }
+      else if (type == Int)
       {
         inttable.lookup_string("0")->code_ref(str);
       }
@@ -1072,100 +1937,354 @@ void CgenClassTable::code_prototypes()
   }
 }
 
-void CgenClassTable::code_initializer()
+bool is_basic_class(Symbol name)
 {
-  for (int i = 0; i < int(cls_ordered.size()); i++)
+  if (name == Int || name == Bool || name == Str || name == Object || name == IO)
+  {
+    return true;
+  }
+  else
+  {
+    return false;
+  }
+}
+
+void CgenClassTable::build_feature_tables()
+{
+  for (auto cls : cls_ordered)
   {
-    Class_ cls = cls_ordered[i];
-    str << cls->get_name() << CLASSINIT_SUFFIX << LABEL;
-    emit_addiu(SP, SP, -12, str);
-    emit_store(FP, 3, SP, str);
-    emit_store(SELF, 2, SP, str);
-    emit_store(RA, 1, SP, str);
-    emit_addiu(FP, SP, 4, str);
-    emit_move(SELF, ACC, str);
+    get_methods_recursively(cls, cls->all_methods);
+    get_class_attrs_recusively(cls, cls->all_attrs);
+  }
+}
+
+//
+// Drop whatever cannot run from the program.  Classes that are never
+// created are removed from `cls_ordered', which renumbers the class
+// tags, and their tables, prototypes and code are not emitted.  A
+// dispatch slot is dropped from the class that introduces it and all
+// its subclasses when none of them has a reachable definition for it;
+// otherwise unreachable definitions keep their slot, filled with an
+// empty word, so the slot numbers used at dispatch sites stay valid.
+//
+void CgenClassTable::prune_unreachable()
+{
+  Reachability reach;
+  reach.analyze();
+
+  std::vector<Class_> dead_classes;
+  std::vector<Class_> live_classes;
+  for (auto cls : cls_ordered)
+  {
+    (reach.class_is_live(cls->get_name()) ? live_classes : dead_classes).push_back(cls);
+  }
 
-    if (cls->get_name() != Object)
+  // A slot is named by the class that introduces it and the method name.
+  auto slot_of = [](Class_ cls, int i) {
+    Class_ intro = cls;
+    while (intro->get_name() != Object &&
+           int(class_map.at(intro->get_parent())->all_methods.size()) > i)
     {
-      str << "\tjal " << cls->get_parent() << CLASSINIT_SUFFIX << endl;
+      intro = class_map.at(intro->get_parent());
     }
+    return std::make_pair(intro->get_name(), cls->all_methods[i].second->get_name());
+  };
+
+  std::set<std::pair<Symbol, Symbol>> used_slots;
+  for (auto cls : live_classes)
+  {
+    for (int i = 0; i < int(cls->all_methods.size()); i++)
+    {
+      Symbol impl = cls->all_methods[i].first->get_name();
+      if (is_basic_class(impl) ||
+          reach.method_is_live(impl, cls->all_methods[i].second->get_name()))
+      {
+        used_slots.insert(slot_of(cls, i));
+      }
+      else
+      {
+        dead_methods.insert(std::make_pair(impl, cls->all_methods[i].second->get_name()));
+      }
+    }
+  }
+
+  // slot_of() looks at the parents' tables, so they are only replaced
+  // once every class has been filtered.
+  int removed_words = 0;
+  std::map<Symbol, std::vector<std::pair<Class_, method_class *>>> kept;
+  for (auto &entry : class_map)
+  {
+    Class_ cls = entry.second;
+    for (int i = 0; i < int(cls->all_methods.size()); i++)
+    {
+      if (used_slots.count(slot_of(cls, i)))
+      {
+        kept[entry.first].push_back(cls->all_methods[i]);
+      }
+      else if (reach.class_is_live(cls->get_name()))
+      {
+        removed_words++;
+      }
+    }
+  }
+  for (auto &entry : class_map)
+  {
+    entry.second->all_methods = kept[entry.first];
+  }
 
+  // Measure the code that is no longer emitted by generating it on the
+  // side.  Every line that starts with a tab is one instruction.
+  std::ostringstream dead_code, dead_maps;
+  int removed_functions = 0;
+  for (auto cls : live_classes)
+  {
+    if (is_basic_class(cls->get_name()))
+    {
+      continue;
+    }
     Environment env;
     env.set_cls(cls);
     for (auto attr : cls->all_attrs)
     {
       env.add_cls_attr(attr);
     }
-
     Features features = cls->get_features();
     for (int i = features->first(); features->more(i); i = features->next(i))
     {
-      attr_class *at = dynamic_cast<attr_class *>(features->nth(i));
-      if (at && !at->get_init()->is_empty())
+      method_class *method = dynamic_cast<method_class *>(features->nth(i));
+      if (method && dead_methods.count(std::make_pair(cls->get_name(), method->get_name())))
       {
-        at->get_init()->code(str, env);
-        emit_store(ACC, DEFAULT_OBJFIELDS + env.get_cls_attr_pos(at->get_name()),
-                   SELF, str);
+        method->code(dead_code, env);
+        removed_functions++;
       }
     }
+  }
+  for (auto cls : dead_classes)
+  {
+    code_initializer(cls, dead_code, dead_maps);
+    code_methods(cls, dead_code, dead_maps);
+    removed_functions++;
+    Features features = cls->get_features();
+    for (int i = features->first(); features->more(i); i = features->next(i))
+    {
+      if (dynamic_cast<method_class *>(features->nth(i)))
+      {
+        removed_functions++;
+      }
+    }
+    // Name, object and parent table entries, the prototype with its
+    // eye catcher, and the dispatch table.
+    removed_words += 4 + DEFAULT_OBJFIELDS + 1 + cls->all_attrs.size() + cls->all_methods.size();
+  }
 
-    emit_move(ACC, SELF, str);
-    emit_load(FP, 3, SP, str);
-    emit_load(SELF, 2, SP, str);
-    emit_load(RA, 1, SP, str);
-    emit_addiu(SP, SP, 12, str);
-
-    emit_return(str);
+  int removed_instructions = 0;
+  std::istringstream lines(dead_code.str());
+  for (std::string line; std::getline(lines, line);)
+  {
+    if (!line.empty() && line[0] == '\t')
+    {
+      removed_instructions++;
+    }
   }
+
+  cls_ordered = live_classes;
+
+  if (cgen_debug)
+    cerr << "removed " << removed_functions << " functions, " << dead_classes.size()
+         << " classes (" << WORD_SIZE * (removed_instructions + removed_words)
+         << " bytes)" << endl;
 }
 
-bool is_basic_class(Symbol name)
+//
+// Under -O the initializer also runs those of the ancestors, instead of
+// calling theirs, and leaves out what the prototype already holds.  One
+// with nothing left to run just returns the object.
+//
+void CgenClassTable::code_initializer(Class_ cls, ostream &s, ostream &maps)
 {
-  if (name == Int || name == Bool || name == Str || name == Object || name == IO)
+  s << cls->get_name() << CLASSINIT_SUFFIX << LABEL;
+  if (cgen_optimize && !has_initializers(cls))
   {
-    return true;
+    emit_return(s);
+    return;
   }
-  else
+
+  Environment env;
+  env.set_label_prefix(std::string(cls->get_name()->get_string()) + CLASSINIT_SUFFIX);
+  for (auto attr : cls->all_attrs)
   {
-    return false;
+    env.add_cls_attr(attr);
   }
+
+  // The classes whose initializers are emitted, ancestors first, with
+  // those initializers.
+  std::vector<std::pair<Class_, std::vector<attr_class *>>> chain;
+  for (Class_ c = cls;; c = class_map.at(c->get_parent()))
+  {
+    chain.insert(chain.begin(), {c, {}});
+    Features features = c->get_features();
+    for (int i = features->first(); features->more(i); i = features->next(i))
+    {
+      attr_class *at = dynamic_cast<attr_class *>(features->nth(i));
+      if (at && !at->get_init()->is_empty() && !is_prototype_constant(cls, at))
+      {
+        chain.front().second.push_back(at);
+      }
+    }
+    if (!cgen_optimize || c->get_name() == Object)
+    {
+      break;
+    }
+  }
+  std::vector<Expression> inits;
+  for (auto &entry : chain)
+  {
+    for (auto at : entry.second)
+    {
+      inits.push_back(at->get_init());
+    }
+  }
+  env.set_cls(cls);
+  allocate_registers(nil_Formals(), inits, env);
+  const std::vector<char *> &saved = env.get_saved_regs();
+
+  // Emitted ahead of the frame, which is sized by the slots it takes.
+  std::ostringstream body;
+  env.start_frame(saved.size() + has_stack_maps());
+  emit_move(SELF, ACC, body);
+  if (!cgen_optimize && cls->get_name() != Object)
+  {
+    body << "\tjal " << cls->get_parent() << CLASSINIT_SUFFIX << endl;
+  }
+
+  for (auto &entry : chain)
+  {
+    // An ancestor's initializers are emitted as they are in its own.
+    env.set_cls(entry.first);
+    for (auto at : entry.second)
+    {
+      at->get_init()->code(body, env);
+      int offset = DEFAULT_OBJFIELDS + env.get_cls_attr_pos(at->get_name());
+      emit_store(ACC, offset, SELF, body);
+      // A collection during the initializers may have promoted self,
+      // and only a call can collect.  Self is new when they start.
+      if (needs_gc_assign(at->get_init()) && (!cgen_optimize || calls_out(body.str())))
+      {
+        emit_addiu(A1, SELF, offset * 4, body);
+        emit_gc_assign(body);
+      }
+    }
+  }
+  emit_move(ACC, SELF, body);
+
+  emit_frame_entry(saved, env.get_frame_slots(), s);
+  s << (cgen_optimize ? number_values(body.str()) : body.str());
+  emit_frame_exit(saved, 0, s);
+  emit_return(s);
+  emit_abort_stubs(s, env);
+  emit_stack_maps(maps, env);
 }
 
-void CgenClassTable::code_methods()
+void CgenClassTable::code_methods(Class_ cls, ostream &s, ostream &maps)
 {
-  for (int i = 0; i < int(cls_ordered.size()); i++)
+  Symbol name = cls->get_name();
+  if (is_basic_class(name))
+  {
+    return;
+  }
+  Environment env;
+  env.set_cls(cls);
+  for (auto attr : cls->all_attrs)
+  {
+    env.add_cls_attr(attr);
+  }
+  auto features = cls->get_features();
+  for (int j = features->first(); features->more(j); j = features->next(j))
   {
-    auto cls = cls_ordered[i];
-    Symbol name = cls->get_name();
-    if (is_basic_class(name))
+    auto feature = features->nth(j);
+    method_class *method = dynamic_cast<method_class *>(feature);
+    if (!method || dead_methods.count(std::make_pair(name, method->get_name())))
     {
       continue;
     }
-    Environment env;
-    env.set_cls(cls);
-    for (auto attr : cls->all_attrs)
+    else
     {
-      env.add_cls_attr(attr);
+      method->code(s, env);
     }
-    auto features = cls->get_features();
-    for (int j = features->first(); features->more(j); j = features->next(j))
+  }
+  emit_stack_maps(maps, env);
+}
+
+//
+// Emit the initializer and methods of every class, and their stack maps
+// into `maps'.  Each class is coded into its own buffers, by up to
+// `cgen_jobs' workers, and the buffers are written out in class tag
+// order, so the output does not depend on the number of workers.
+// Nothing reachable from here may touch shared mutable state: labels
+// come from the Environment of the routine being emitted.  The one
+// write to shared data is code_ref setting the atomic `referenced' flag
+// of a string or int constant (stringtab.h).  clear_references resets
+// those flags before this runs, and code_constants reads them only
+// after every worker has joined.
+//
+void CgenClassTable::code_class_text(ostream &s, ostream &maps)
+{
+  int n = cls_ordered.size();
+  std::vector<std::ostringstream> bufs(n), map_bufs(n);
+  std::atomic<int> next(0);
+
+  auto worker = [&]() {
+    for (int i = next++; i < n; i = next++)
     {
-      auto feature = features->nth(j);
-      method_class *method = dynamic_cast<method_class *>(feature);
-      if (!method)
-      {
-        continue;
-      }
-      else
-      {
-        method->code(str, env);
-      }
+      code_initializer(cls_ordered[i], bufs[i], map_bufs[i]);
+      code_methods(cls_ordered[i], bufs[i], map_bufs[i]);
     }
+  };
+
+  std::vector<std::thread> pool;
+  for (int j = 1; j < std::min(cgen_jobs, n); j++)
+  {
+    pool.push_back(std::thread(worker));
+  }
+  worker();
+  for (auto &t : pool)
+  {
+    t.join();
+  }
+
+  for (int i = 0; i < n; i++)
+  {
+    s << bufs[i].str();
+    maps << map_bufs[i].str();
   }
 }
 
 void CgenClassTable::code()
 {
+  //
+  // Add constants that are required by the code generator.
+  //
+  stringtable.add_string("");
+  inttable.add_string("0");
+
+  if (cgen_debug)
+    cout << "pruning unreachable code" << endl;
+  prune_unreachable();
+  analyze_hierarchy(dead_methods);
+  if (cgen_optimize)
+  {
+    infer_types();
+    inline_methods();
+    replace_allocations();
+    hoist_invariants();
+  }
+  // The code measured while pruning is not emitted.
+  dispatch_sites = direct_dispatch_sites = guarded_dispatch_sites = 0;
+
+  // Only references from the code that is emitted count.
+  stringtable.clear_references();
+  inttable.clear_references();
+
   if (cgen_debug)
     cout << "coding global data" << endl;
   code_global_data();
@@ -1174,10 +2293,6 @@ void CgenClassTable::code()
     cout << "choosing gc" << endl;
   code_select_gc();
 
-  if (cgen_debug)
-    cout << "coding constants" << endl;
-  code_constants();
-
   //                 Add your code to emit
   //                   - prototype objects
   //                   - class_nameTab
@@ -1190,16 +2305,28 @@ void CgenClassTable::code()
   code_dispatch_tables();
   code_prototypes();
 
-  if (cgen_debug)
-    cout << "coding global text" << endl;
-  code_global_text();
-
   //                 Add your code to emit
   //                   - object initializer
   //                   - the class methods
   //                   - etc...
-  code_initializer();
-  code_methods();
+  if (cgen_debug)
+    cout << "coding class text with " << cgen_jobs << " job(s)" << endl;
+  std::ostringstream text, maps;
+  code_class_text(text, maps);
+  if (cgen_debug)
+    cerr << "devirtualized " << direct_dispatch_sites << " of " << dispatch_sites
+         << " dispatch sites (" << guarded_dispatch_sites << " guarded)" << endl;
+
+  if (cgen_debug)
+    cout << "coding constants" << endl;
+  code_constants();
+  // The stack maps are data the heap must not start before.
+  str << maps.str();
+
+  if (cgen_debug)
+    cout << "coding global text" << endl;
+  code_global_text();
+  str << text.str();
 }
 
 CgenNodeP CgenClassTable::root()
@@ -1233,28 +2360,48 @@ CgenNode::CgenNode(Class_ nd, Basicness bstatus, CgenClassTableP ct) : class__cl
 
 void assign_class::code(ostream &s, Environment &env)
 {
-  expr->code(s, env);
   int pos, offset;
-  pos = env.get_let_var_pos_rev(name);
-  if (pos != -1)
+  char *reg;
+  bool unboxed;
+  if (env.lookup_local(name, &reg, &unboxed) && unboxed)
+  {
+    code_value(s, env);
+    emit_box(type, s, env);
+    return;
+  }
+
+  expr->code(s, env);
+  if (env.lookup_local(name, &reg))
   {
-    offset = pos + 1;
-    emit_store(ACC, offset, SP, s);
-    if (cgen_Memmgr == GC_GENGC)
+    if (reg)
     {
-      emit_addiu(A1, SP, 4 * offset, s);
+      emit_move(reg, ACC, s);
+      return;
+    }
+    offset = env.get_slot_offset(name);
+    emit_store(ACC, offset, frame_base(env), s);
+    // The collector scans the whole stack, so under -O it is not told.
+    if (cgen_Memmgr == GC_GENGC && !cgen_optimize)
+    {
+      emit_addiu(A1, frame_base(env), 4 * offset, s);
       emit_gc_assign(s);
     }
+    return;
   }
 
+  if ((reg = env.get_arg_reg(name)))
+  {
+    emit_move(reg, ACC, s);
+    return;
+  }
   pos = env.get_arg_pos(name);
   if (pos != -1)
   {
-    offset = 2 + env.get_mth_args_size() - pos;
-    emit_store(ACC, offset, FP, s);
-    if (cgen_Memmgr == GC_GENGC)
+    offset = env.get_arg_offset(pos);
+    emit_store(ACC, offset, frame_base(env), s);
+    if (cgen_Memmgr == GC_GENGC && !cgen_optimize)
     {
-      emit_addiu(A1, FP, offset * 4, s);
+      emit_addiu(A1, frame_base(env), offset * 4, s);
       emit_gc_assign(s);
     }
     return;
@@ -1265,7 +2412,7 @@ void assign_class::code(ostream &s, Environment &env)
   {
     offset = DEFAULT_OBJFIELDS + pos;
     emit_store(ACC, offset, SELF, s);
-    if (cgen_Memmgr == GC_GENGC)
+    if (needs_gc_assign(expr) && !env.is_young_store(this))
     {
       emit_addiu(A1, SELF, offset * 4, s);
       emit_gc_assign(s);
@@ -1274,6 +2421,117 @@ void assign_class::code(ostream &s, Environment &env)
   }
 }
 
+void assign_class::code_value(ostream &s, Environment &env)
+{
+  char *reg;
+  bool unboxed;
+  if (!env.lookup_local(name, &reg, &unboxed) || !unboxed)
+  {
+    Expression_class::code_value(s, env);
+    return;
+  }
+
+  expr->code_value(s, env);
+  if (reg)
+  {
+    emit_move(reg, ACC, s);
+  }
+  else
+  {
+    emit_store(ACC, env.get_slot_offset(name), frame_base(env), s);
+  }
+}
+
+//
+// Under -O a call of `impl'.`name' in tail position of a method does not
+// keep the frame of the method.  The `num_params' arguments are on the
+// stack and the receiver is in ACC.  A call of the method itself stores
+// the arguments over its own and jumps back to the start of the body.
+// Any other call restores what the method saved, moves the arguments
+// over the ones it was called with, and jumps to the callee, which then
+// returns to the method's caller.  The arguments are copied from the
+// first, which is deepest in the stack, and the new place is never
+// below the old one, so none is overwritten before it is read.  Returns
+// false if `site' has to be a normal call.
+//
+static bool emit_tail_call(Expression site, Class_ impl, Symbol name, int num_params,
+                           ostream &s, Environment &env)
+{
+  if (!env.is_tail_call(site))
+  {
+    return false;
+  }
+
+  int num_args = env.get_mth_args_size();
+  const std::vector<char *> &saved = env.get_saved_regs();
+  int nsaved = saved.size();
+  if (impl == env.get_cls() && name == env.get_method()->get_name())
+  {
+    for (int i = 0; i < num_params; i++)
+    {
+      emit_load(T1, num_params - i, SP, s);
+      emit_store(T1, 2 + num_args - i, FP, s);
+    }
+    emit_addiu(SP, SP, 4 * num_params, s);
+    // The body starts again with no raw slots.
+    std::vector<int> raw = env.get_raw_slot_offsets();
+    for (int offset : raw)
+    {
+      emit_store(ZERO, offset, FP, s);
+    }
+    if (!raw.empty())
+    {
+      emit_store(ZERO, -1, FP, s);
+    }
+    emit_branch(env.get_body_label(), s);
+    return true;
+  }
+
+  for (int i = 0; i < nsaved; i++)
+  {
+    emit_load(saved[i], saved_reg_offset(i, nsaved), FP, s);
+  }
+  emit_load(RA, 0, FP, s);
+  emit_load(SELF, 1, FP, s);
+  emit_load(T2, 2, FP, s);
+  for (int i = 0; i < num_params; i++)
+  {
+    emit_load(T1, num_params - i, SP, s);
+    emit_store(T1, 2 + num_args - i, FP, s);
+  }
+  emit_addiu(SP, FP, 8 + 4 * (num_args - num_params), s);
+  emit_move(FP, T2, s);
+  s << JUMP;
+  emit_method_ref(impl->get_name(), name, s);
+  s << endl;
+  return true;
+}
+
+//
+// Under -O a call of String.length or Object.type_name is replaced by
+// the loads the runtime does, with the receiver in ACC.  `impl' is the
+// only definition the call can run, so a class overriding type_name
+// still gets its own.  Returns false if `impl'.`name' is another method.
+//
+static bool emit_builtin_load(Class_ impl, Symbol name, ostream &s)
+{
+  if (!cgen_optimize || !is_builtin_load(impl, name))
+  {
+    return false;
+  }
+  if (name == length)
+  {
+    emit_load(ACC, DEFAULT_OBJFIELDS, ACC, s);
+    return true;
+  }
+  emit_load(T1, TAG_OFFSET, ACC, s);
+  emit_sll(T1, T1, 2, s);
+  emit_load_address(T2, CLASSNAMETAB, s);
+  emit_addu(T1, T1, T2, s);
+  emit_load(ACC, 0, T1, s);
+  return true;
+}
+
 void static_dispatch_class::code(ostream &s, Environment &env)
 {
   int num_params = 0;
@@ -1281,34 +2539,21 @@ void static_dispatch_class::code(ostream &s, Environment &env)
   {
     actual->nth(i)->code(s, env);
     emit_push(ACC, s);
-    env.push_stack_symbol(No_type);
     num_params++;
   }
   expr->code(s, env);
-
-  emit_bne(ACC, ZERO, label_num, s);
-  emit_partial_load_address(ACC, s);
-  stringtable.lookup_string(env.get_cls()->get_filename()->get_string())->code_ref(s);
-  s << endl;
-  emit_load_imm(T1, get_line_number(), s);
-  emit_jal(DISPATH_ABORT, s);
-  emit_label_def(label_num++, s);
-  emit_load_address(T1, (char *)(std::string(type_name->get_string()) + DISPTAB_SUFFIX).c_str(), s);
-  Class_ cls = class_map[type_name];
-  int i = 0;
-  for (int i = 0; i < int(cls->all_methods.size()); i++)
+  if (!is_non_void(expr, env))
   {
-    if (cls->all_methods[i].second->get_name() == name)
-    {
-      break;
-    }
+    emit_abort_if_void(DISPATH_ABORT, get_line_number(), s, env);
   }
-  emit_load(T1, i, T1, s);
-  emit_jalr(T1, s);
-
-  for (int i = 0; i < num_params; i++)
+  // `@type_name' fixes the method that runs, so it is called directly.
+  Class_ impl = find_method_impl(type_name, name, NULL);
+  if (!emit_builtin_load(impl, name, s) &&
+      !emit_tail_call(this, impl, name, num_params, s, env))
   {
-    env.pop_stack_symbol();
+    s << JAL;
+    emit_method_ref(impl->get_name(), name, s);
+    s << endl;
   }
 }
 
@@ -1319,50 +2564,93 @@ void dispatch_class::code(ostream &s, Environment &env)
   {
     actual->nth(i)->code(s, env);
     emit_push(ACC, s);
-    env.push_stack_symbol(No_type);
     num_params++;
   }
 
   expr->code(s, env);
-  emit_bne(ACC, ZERO, label_num, s);
-  emit_partial_load_address(ACC, s);
-  stringtable.lookup_string(env.get_cls()->get_name()->get_string())->code_ref(s);
-  s << endl;
-  emit_load_imm(T1, get_line_number(), s);
-  emit_jal(DISPATH_ABORT, s);
+  if (!is_non_void(expr, env))
+  {
+    emit_abort_if_void(DISPATH_ABORT, get_line_number(), s, env);
+  }
 
-  emit_label_def(label_num++, s);
-  emit_load(T1, 2, SELF, s);
   Class_ cls = env.get_cls();
   if (expr->get_type() != SELF_TYPE)
   {
-    cls = class_map[expr->get_type()];
+    cls = class_map.at(expr->get_type());
   }
-  int i = 0;
-  for (i = 0; i < int(cls->all_methods.size()); i++)
+  dispatch_sites++;
+  auto emit_table_dispatch = [&]() {
+    emit_load(T1, DISPTABLE_OFFSET, ACC, s);
+    int i = 0;
+    for (i = 0; i < int(cls->all_methods.size()); i++)
+    {
+      if (cls->all_methods[i].second->get_name() == name)
+      {
+        break;
+      }
+    }
+    emit_load(T1, i, T1, s);
+    emit_jalr(T1, s);
+  };
+
+  // The class hierarchy alone is always right.  Inferred types are
+  // checked against the class tag of the receiver unless -u is given,
+  // which is only possible when the receiver has a single class.
+  Symbol receiver = NULL;
+  Class_ impl = unique_method_impl(cls->get_name(), name);
+  bool guarded = false;
+  if (!impl && (impl = inferred_method_impl(this, &receiver)))
   {
-    if (cls->all_methods[i].second->get_name() == name)
+    guarded = !guard_free;
+    if (guarded && !receiver)
     {
-      break;
+      impl = NULL;
     }
   }
-  emit_load(T1, i, T1, s);
-  emit_jalr(T1, s);
-  for (int i = 0; i < num_params; i++)
+
+  if (!impl)
   {
-    env.pop_stack_symbol();
+    emit_table_dispatch();
+  }
+  else if (guarded)
+  {
+    direct_dispatch_sites++;
+    guarded_dispatch_sites++;
+    std::string label_other = env.new_label();
+    std::string label_done = env.new_label();
+    emit_load(T1, TAG_OFFSET, ACC, s);
+    emit_load_imm(T2, get_class_tag(receiver), s);
+    emit_bne(T1, T2, label_other, s);
+    if (!emit_builtin_load(impl, name, s))
+    {
+      s << JAL;
+      emit_method_ref(impl->get_name(), name, s);
+      s << endl;
+    }
+    emit_branch(label_done, s);
+    emit_label_def(label_other, s);
+    emit_table_dispatch();
+    emit_label_def(label_done, s);
+  }
+  else
+  {
+    direct_dispatch_sites++;
+    if (!emit_builtin_load(impl, name, s) &&
+      !emit_tail_call(this, impl, name, num_params, s, env))
+    {
+      s << JAL;
+      emit_method_ref(impl->get_name(), name, s);
+      s << endl;
+    }
   }
 }
 
 void cond_class::code(ostream &s, Environment &env)
 {
-  pred->code(s, env);
-  emit_fetch_int(T1, ACC, s);
-
-  int label_false = label_num++;
-  int label_end = label_num++;
+  std::string label_false = env.new_label();
+  std::string label_end = env.new_label();
 
-  emit_beq(T1, ZERO, label_false, s);
+  emit_branch_on(pred, false, label_false, s, env);
   then_exp->code(s, env);
   emit_branch(label_end, s);
 
@@ -1372,83 +2660,284 @@ void cond_class::code(ostream &s, Environment &env)
   emit_label_def(label_end, s);
 }
 
+void cond_class::code_value(ostream &s, Environment &env)
+{
+  std::string label_false = env.new_label();
+  std::string label_end = env.new_label();
+
+  emit_branch_on(pred, false, label_false, s, env);
+  then_exp->code_value(s, env);
+  emit_branch(label_end, s);
+
+  emit_label_def(label_false, s);
+  else_exp->code_value(s, env);
+
+  emit_label_def(label_end, s);
+}
+
+//
+// The test comes after the body, so an iteration takes one branch.
+//
 void loop_class::code(ostream &s, Environment &env)
 {
-  int label_loop = label_num++;
-  int label_exit = label_num++;
-  emit_label_def(label_loop, s);
+  std::string label_body = env.new_label();
+  std::string label_test = env.new_label();
+  emit_branch(label_test, s);
 
-  pred->code(s, env);
-  emit_fetch_int(T1, ACC, s);
-  emit_beq(T1, ZERO, label_exit, s);
-  body->code(s, env);
-  emit_branch(label_loop, s);
-  emit_label_def(label_exit, s);
+  emit_label_def(label_body, s);
+  emit_effect(body, s, env);
+  emit_label_def(label_test, s);
+  emit_branch_on(pred, true, label_body, s, env);
   emit_move(ACC, ZERO, s);
 }
 
 void typcase_class::code(ostream &s, Environment &env)
 {
   expr->code(s, env);
-  emit_push(ACC, s);
+  char *reg = env.get_reg(this);
+  if (reg)
+  {
+    emit_move(reg, ACC, s);
+  }
+  else
+  {
+    emit_store(ACC, env.push_stack_symbol(No_type), frame_base(env), s);
+  }
 
-  emit_bne(ACC, ZERO, label_num, s);
-  emit_partial_load_address(ACC, s);
-  stringtable.lookup_string(env.get_cls()->get_name()->get_string())->code_ref(s);
-  s << endl;
-  emit_load_imm(T1, get_line_number(), s);
-  emit_jal("_case_abort2", s);
-  emit_label_def(label_num++, s);
-  int label_begin = label_num++;
-  int label_end = label_num++;
-  int label_tag_is_valid = label_num++;
+  if (!is_non_void(expr, env))
+  {
+    emit_abort_if_void("_case_abort2", get_line_number(), s, env);
+  }
+  std::string label_begin = env.new_label();
+  std::string label_end = env.new_label();
 
   emit_load(T1, TAG_OFFSET, ACC, s);
 
   emit_label_def(label_begin, s);
   emit_load_imm(T2, INVALID_CLASSTAG, s);
-  emit_bne(T1, T2, label_tag_is_valid, s);
-  emit_jal("_case_abort", s);
-
-  emit_label_def(label_tag_is_valid, s);
-  int label_branch_0 = label_num;
+  emit_beq(T1, T2, env.get_abort_stub("_case_abort", NULL, 0), s);
+  std::vector<std::string> label_branches;
   for (int i = cases->first(); cases->more(i); i = cases->next(i))
   {
-    emit_load_imm(T2, get_class_tag(cases->nth(i)->get_type_decl()), s);
-    emit_beq(T2, T1, label_num++, s);
+    label_branches.push_back(env.new_label());
+    // No object can have the type of a branch whose class was pruned, and
+    // with -u branches no inferred type selects are dropped as well.
+    int tag = get_class_tag(cases->nth(i)->get_type_decl());
+    if (tag != -1 && (!guard_free || case_branch_is_taken(this, i)))
+    {
+      emit_load_imm(T2, tag, s);
+      emit_beq(T2, T1, label_branches.back(), s);
+    }
   }
   emit_load_address(T2, CLASSPARENTTAB, s);
-  emit_load_imm(T3, 4, s);
-  emit_mul(T3, T3, T1, s);
-  emit_add(T2, T2, T3, s);
+  emit_sll(T3, T1, 2, s);
+  emit_addu(T2, T2, T3, s);
   emit_load(T1, 0, T2, s);
   emit_branch(label_begin, s);
 
   for (int i = cases->first(); cases->more(i); i = cases->next(i))
   {
-    emit_label_def(label_branch_0++, s);
+    if (get_class_tag(cases->nth(i)->get_type_decl()) == -1 ||
+        (guard_free && !case_branch_is_taken(this, i)))
+    {
+      continue;
+    }
+    emit_label_def(label_branches[i], s);
     auto c = cases->nth(i);
-    env.push_stack_symbol(c->get_name());
+    if (!reg)
+    {
+      env.name_stack_symbol(c->get_name());
+    }
+    env.push_local(c->get_name(), reg, false, !is_assigned(c->get_name(), c->get_expr()));
     c->get_expr()->code(s, env);
+    env.pop_local();
+    emit_branch(label_end, s);
+  }
+  emit_label_def(label_end, s);
+  if (!reg)
+  {
+    env.pop_stack_symbol();
+  }
+}
+
+void block_class::code(ostream &s, Environment &env)
+{
+  for (int i = body->first(); body->more(i); i = body->next(i))
+  {
+    if (body->more(body->next(i)))
+    {
+      emit_effect(body->nth(i), s, env);
+    }
+    else
+    {
+      body->nth(i)->code(s, env);
+    }
+  }
+}
+
+void block_class::code_value(ostream &s, Environment &env)
+{
+  for (int i = body->first(); body->more(i); i = body->next(i))
+  {
+    if (body->more(body->next(i)))
+    {
+      emit_effect(body->nth(i), s, env);
+    }
+    else
+    {
+      body->nth(i)->code_value(s, env);
+    }
+  }
+}
+
+//
+// An unboxed binding holds its machine integer, in an unboxed temporary
+// if the body runs no Cool code.
+//
+//
+// Under -O and -g, mark the assignments to attributes that start the body
+// of a binding of self to a new object, which has no initializer to run,
+// and that nothing before them can collect: the object is still young.
+// Reading a variable collects nothing, unless it is unboxed and its value
+// has to be boxed.
+//
+static void find_young_stores(let_class *let, Environment &env)
+{
+  auto n = dynamic_cast<new__class *>(let->init);
+  if (!cgen_optimize || cgen_Memmgr != GC_GENGC || !n || n->type_name == SELF_TYPE ||
+      has_initializers(class_map.at(n->type_name)))
+  {
+    return;
+  }
+  std::vector<Expression> body;
+  if (auto b = dynamic_cast<block_class *>(let->body))
+  {
+    for (int i = b->body->first(); b->body->more(i); i = b->body->next(i))
+    {
+      body.push_back(b->body->nth(i));
+    }
+  }
+  else
+  {
+    body.push_back(let->body);
+  }
+  for (Expression e : body)
+  {
+    auto a = dynamic_cast<assign_class *>(e);
+    if (!a)
+    {
+      return;
+    }
+    auto o = dynamic_cast<object_class *>(a->expr);
+    char *reg;
+    bool unboxed = false;
+    if (o ? env.lookup_local(o->name, &reg, &unboxed) && unboxed
+          : !(dynamic_cast<int_const_class *>(a->expr) ||
+              dynamic_cast<string_const_class *>(a->expr) ||
+              dynamic_cast<bool_const_class *>(a->expr)))
+    {
+      return;
+    }
+    env.add_young_store(a);
+  }
+}
+
+//
+// The optimizer inlines a method called on another object by binding
+// `self', which Cool code cannot, to the receiver around its body.  The
+// body runs with $s0 set to the receiver and the attributes of the
+// method's class in scope, and the void check of the dispatch is kept.
+//
+static void emit_rebind_self(let_class *let, bool value, ostream &s, Environment &env)
+{
+  let->init->code(s, env);
+  if (!is_non_void(let->init, env))
+  {
+    emit_abort_if_void(DISPATH_ABORT, let->get_line_number(), s, env);
+  }
+
+  find_young_stores(let, env);
+  char *reg = env.get_reg(let);
+  if (reg)
+  {
+    emit_move(reg, SELF, s);
+  }
+  else
+  {
+    emit_store(SELF, env.push_stack_symbol(No_type), frame_base(env), s);
+  }
+  emit_move(SELF, ACC, s);
+
+  Class_ cls = env.get_cls();
+  std::vector<attr_class *> attrs = env.get_cls_attrs();
+  Class_ callee = class_map.at(let->type_decl);
+  env.set_cls(callee);
+  env.set_cls_attrs(callee->all_attrs);
+  if (value)
+  {
+    let->body->code_value(s, env);
+  }
+  else
+  {
+    let->body->code(s, env);
+  }
+  env.set_cls(cls);
+  env.set_cls_attrs(attrs);
+
+  if (reg)
+  {
+    emit_move(SELF, reg, s);
+  }
+  else
+  {
+    emit_load(SELF, env.get_top_slot_offset(), frame_base(env), s);
     env.pop_stack_symbol();
-    emit_branch(label_end, s);
   }
-  emit_label_def(label_end, s);
-  emit_addiu(SP, SP, 4, s);
 }
 
-void block_class::code(ostream &s, Environment &env)
+static void emit_let(let_class *let, bool value, ostream &s, Environment &env)
 {
-  for (int i = body->first(); body->more(i); i = body->next(i))
+  if (let->identifier == self)
   {
-    body->nth(i)->code(s, env);
+    emit_rebind_self(let, value, s, env);
+    return;
   }
-}
 
-void let_class::code(ostream &s, Environment &env)
-{
-  init->code(s, env);
-  if (init->is_empty())
+  Symbol type_decl = let->type_decl;
+  Expression init = let->init;
+  bool non_void = !init->is_empty() && is_non_void(init, env) &&
+                  !is_assigned(let->identifier, let->body);
+  bool unboxed = unbox_binding(let);
+  char *reg = env.get_reg(let);
+  bool in_scratch = unboxed && !reg && !may_call(let->body) && scratch_free(env);
+  // The collector would take a machine integer in a register it scans,
+  // or in a slot not in the stack map, for a pointer.
+  bool raw = unboxed && !in_scratch && has_stack_maps();
+  if (raw)
+  {
+    reg = NULL;
+  }
+  else if (unboxed && !in_scratch && cgen_Memmgr == GC_GENGC)
+  {
+    unboxed = false;
+  }
+
+  if (unboxed)
+  {
+    if (init->is_empty())
+    {
+      emit_load_imm(ACC, 0, s);
+    }
+    else
+    {
+      init->code_value(s, env);
+    }
+  }
+  else
+  {
+    init->code(s, env);
+  }
+  if (!unboxed && init->is_empty())
   {
     if (type_decl == Str)
     {
@@ -1467,180 +2956,242 @@ void let_class::code(ostream &s, Environment &env)
       emit_move(ACC, ZERO, s);
     }
   }
-  emit_push(ACC, s);
-  env.push_stack_symbol(identifier);
-  body->code(s, env);
-  emit_addiu(SP, SP, 4, s);
-  env.pop_stack_symbol();
+
+  if (in_scratch)
+  {
+    reg = acquire_scratch(env);
+  }
+  if (reg)
+  {
+    emit_move(reg, ACC, s);
+  }
+  else if (raw)
+  {
+    emit_push_raw(let->identifier, s, env);
+  }
+  else
+  {
+    emit_store(ACC, env.push_stack_symbol(let->identifier), frame_base(env), s);
+  }
+  env.push_local(let->identifier, reg, unboxed, non_void);
+  if (value)
+  {
+    let->body->code_value(s, env);
+  }
+  else
+  {
+    let->body->code(s, env);
+  }
+  env.pop_local();
+  if (in_scratch)
+  {
+    release_scratch(env);
+  }
+  if (raw)
+  {
+    emit_pop_raw(s, env);
+  }
+  else if (!reg)
+  {
+    env.pop_stack_symbol();
+  }
 }
 
-void plus_class::code(ostream &s, Environment &env)
+void let_class::code(ostream &s, Environment &env)
 {
-  e1->code(s, env);
-  emit_push(ACC, s);
-  env.push_stack_symbol(No_type);
-  e2->code(s, env);
-  emit_jal("Object.copy", s);
+  emit_let(this, false, s, env);
+}
 
-  emit_addiu(SP, SP, 4, s);
-  emit_load(T1, 0, SP, s);
-  env.pop_stack_symbol();
+void let_class::code_value(ostream &s, Environment &env)
+{
+  emit_let(this, true, s, env);
+}
 
-  emit_move(T2, ACC, s);
+//
+// Whether `e' is an Int constant 2^`shift', which a multiplication or
+// division by it can shift by instead.
+//
+static bool is_power_of_two(Expression e, int *shift)
+{
+  auto c = dynamic_cast<int_const_class *>(e);
+  if (!c)
+  {
+    return false;
+  }
+  int value = atoi(c->token->get_string());
+  if (value <= 0 || (value & (value - 1)) != 0)
+  {
+    return false;
+  }
+  for (*shift = 0; value > 1; value >>= 1)
+  {
+    (*shift)++;
+  }
+  return true;
+}
 
-  emit_fetch_int(T1, T1, s);
-  emit_fetch_int(T2, T2, s);
-  emit_add(T1, T1, T2, s);
+void plus_class::code(ostream &s, Environment &env)
+{
+  code_value(s, env);
+  emit_box(Int, s, env);
+}
 
-  emit_store(T1, 3, ACC, s);
+void plus_class::code_value(ostream &s, Environment &env)
+{
+  emit_operand_values(this, e1, e2, s, env);
+  emit_add(ACC, T1, T2, s);
 }
 
 void sub_class::code(ostream &s, Environment &env)
 {
-  e1->code(s, env);
-  emit_push(ACC, s);
-  env.push_stack_symbol(No_type);
-
-  e2->code(s, env);
-  emit_jal("Object.copy", s);
-
-  emit_addiu(SP, SP, 4, s);
-  emit_load(T1, 0, SP, s);
-  env.pop_stack_symbol();
-
-  emit_move(T2, ACC, s);
-  emit_fetch_int(T1, T1, s);
-  emit_fetch_int(T2, T2, s);
-  emit_sub(T1, T1, T2, s);
+  code_value(s, env);
+  emit_box(Int, s, env);
+}
 
-  emit_store(T1, 3, ACC, s);
+void sub_class::code_value(ostream &s, Environment &env)
+{
+  emit_operand_values(this, e1, e2, s, env);
+  emit_sub(ACC, T1, T2, s);
 }
 
 void mul_class::code(ostream &s, Environment &env)
 {
-  e1->code(s, env);
-  emit_push(ACC, s);
-  env.push_stack_symbol(No_type);
-  e2->code(s, env);
-
-  emit_jal("Object.copy", s);
-
-  emit_addiu(SP, SP, 4, s);
-  emit_load(T1, 0, SP, s);
-
-  env.pop_stack_symbol();
-
-  emit_move(T2, ACC, s);
-
-  emit_fetch_int(T1, T1, s);
-  emit_fetch_int(T2, T2, s);
-  emit_mul(T1, T1, T2, s);
+  code_value(s, env);
+  emit_box(Int, s, env);
+}
 
-  emit_store(T1, 3, ACC, s);
+void mul_class::code_value(ostream &s, Environment &env)
+{
+  int shift;
+  Expression other = is_power_of_two(e2, &shift)   ? e1
+                     : is_power_of_two(e1, &shift) ? e2
+                                                   : NULL;
+  if (other)
+  {
+    other->code_value(s, env);
+    if (shift > 0)
+    {
+      emit_sll(ACC, ACC, shift, s);
+    }
+    return;
+  }
+  emit_operand_values(this, e1, e2, s, env);
+  emit_mul(ACC, T1, T2, s);
 }
 
 void divide_class::code(ostream &s, Environment &env)
 {
-  e1->code(s, env);
-  emit_push(ACC, s);
-  env.push_stack_symbol(No_type);
-
-  e2->code(s, env);
-  emit_jal("Object.copy", s);
-
-  emit_addiu(SP, SP, 4, s);
-  emit_load(T1, 0, SP, s);
-
-  env.pop_stack_symbol();
-
-  emit_move(T2, ACC, s);
-  emit_fetch_int(T1, T1, s);
-  emit_fetch_int(T2, T2, s);
+  code_value(s, env);
+  emit_box(Int, s, env);
+}
 
-  emit_div(T1, T1, T2, s);
-  emit_store(T1, 3, ACC, s);
+//
+// Division rounds toward zero, so a shift divides a negative dividend
+// only once it is biased by the divisor less one.
+//
+void divide_class::code_value(ostream &s, Environment &env)
+{
+  int shift;
+  if (is_power_of_two(e2, &shift))
+  {
+    e1->code_value(s, env);
+    if (shift > 0)
+    {
+      if (shift > 1)
+      {
+        emit_sra(T1, ACC, 31, s);
+        emit_srl(T1, T1, 32 - shift, s);
+      }
+      else
+      {
+        emit_srl(T1, ACC, 31, s);
+      }
+      emit_addu(ACC, ACC, T1, s);
+      emit_sra(ACC, ACC, shift, s);
+    }
+    return;
+  }
+  emit_operand_values(this, e1, e2, s, env);
+  emit_div(ACC, T1, T2, s);
 }
 
 void neg_class::code(ostream &s, Environment &env)
 {
-  e1->code(s, env);
-  emit_jal("Object.copy", s);
+  code_value(s, env);
+  emit_box(Int, s, env);
+}
 
-  emit_fetch_int(T1, ACC, s);
-  emit_neg(T1, T1, s);
-  emit_store(T1, 3, ACC, s);
+void neg_class::code_value(ostream &s, Environment &env)
+{
+  e1->code_value(s, env);
+  emit_neg(ACC, ACC, s);
 }
 
 void lt_class::code(ostream &s, Environment &env)
 {
-  e1->code(s, env);
-  emit_push(ACC, s);
-
-  env.push_stack_symbol(No_type);
-  e2->code(s, env);
-  emit_addiu(SP, SP, 4, s);
-  emit_load(T1, 0, SP, s);
-  env.pop_stack_symbol();
+  emit_comparison(this, e1, e2, emit_blt, true, s, env);
+}
 
-  emit_move(T2, ACC, s);
-  emit_fetch_int(T1, T1, s);
-  emit_fetch_int(T2, T2, s);
-  emit_load_bool(ACC, BoolConst(1), s);
-  emit_blt(T1, T2, label_num, s);
-  emit_load_bool(ACC, BoolConst(0), s);
-  emit_label_def(label_num++, s);
+void lt_class::code_value(ostream &s, Environment &env)
+{
+  emit_comparison(this, e1, e2, emit_blt, false, s, env);
 }
 
 void eq_class::code(ostream &s, Environment &env)
 {
-  e1->code(s, env);
-  emit_push(ACC, s);
-  env.push_stack_symbol(No_type);
-
-  e2->code(s, env);
-  emit_addiu(SP, SP, 4, s);
-  emit_load(T1, 0, SP, s);
-  env.pop_stack_symbol();
-
-  emit_move(T2, ACC, s);
+  if (is_unboxed_type(e1->get_type()))
+  {
+    emit_comparison(this, e1, e2, emit_beq, true, s, env);
+    return;
+  }
 
-  emit_fetch_int(T1, T1, s);
-  emit_fetch_int(T2, T2, s);
+  emit_object_operands(this, s, env);
+  std::string label_done = env.new_label();
   emit_load_bool(ACC, BoolConst(1), s);
-  emit_beq(T1, T2, label_num, s);
-  emit_load_bool(ACC, BoolConst(0), s);
-  emit_label_def(label_num++, s);
+  emit_beq(T1, T2, label_done, s);
+  if (may_compare_values(this))
+  {
+    emit_load_bool(A1, BoolConst(0), s);
+    emit_jal("equality_test", s);
+  }
+  else
+  {
+    emit_load_bool(ACC, BoolConst(0), s);
+  }
+  emit_label_def(label_done, s);
 }
 
-void leq_class::code(ostream &s, Environment &env)
+void eq_class::code_value(ostream &s, Environment &env)
 {
-  e1->code(s, env);
-  emit_push(ACC, s);
-  env.push_stack_symbol(No_type);
-
-  e2->code(s, env);
-  emit_addiu(SP, SP, 4, s);
-  emit_load(T1, 0, SP, s);
-  env.pop_stack_symbol();
+  if (is_unboxed_type(e1->get_type()))
+  {
+    emit_comparison(this, e1, e2, emit_beq, false, s, env);
+    return;
+  }
+  Expression_class::code_value(s, env);
+}
 
-  emit_move(T2, ACC, s);
-  emit_fetch_int(T1, T1, s);
-  emit_fetch_int(T2, T2, s);
+void leq_class::code(ostream &s, Environment &env)
+{
+  emit_comparison(this, e1, e2, emit_bleq, true, s, env);
+}
 
-  emit_load_bool(ACC, BoolConst(1), s);
-  emit_bleq(T1, T2, label_num, s);
-  emit_load_bool(ACC, BoolConst(0), s);
-  emit_label_def(label_num++, s);
+void leq_class::code_value(ostream &s, Environment &env)
+{
+  emit_comparison(this, e1, e2, emit_bleq, false, s, env);
 }
 
 void comp_class::code(ostream &s, Environment &env)
 {
-  e1->code(s, env);
-  emit_fetch_int(T1, ACC, s);
-  emit_load_bool(ACC, BoolConst(1), s);
-  emit_beq(T1, ZERO, label_num, s);
-  emit_load_bool(ACC, BoolConst(0), s);
-  emit_label_def(label_num++, s);
+  e1->code_value(s, env);
+  emit_is_zero(true, s, env);
+}
+
+void comp_class::code_value(ostream &s, Environment &env)
+{
+  e1->code_value(s, env);
+  emit_load_imm(T1, 1, s);
+  emit_sub(ACC, T1, ACC, s);
 }
 
 void int_const_class::code(ostream &s, Environment &env)
@@ -1651,6 +3202,11 @@ void int_const_class::code(ostream &s, Environment &env)
   emit_load_int(ACC, inttable.lookup_string(token->get_string()), s);
 }
 
+void int_const_class::code_value(ostream &s, Environment &env)
+{
+  emit_load_imm(ACC, atoi(token->get_string()), s);
+}
+
 void string_const_class::code(ostream &s, Environment &env)
 {
   emit_load_string(ACC, stringtable.lookup_string(token->get_string()), s);
@@ -1661,47 +3217,50 @@ void bool_const_class::code(ostream &s, Environment &env)
   emit_load_bool(ACC, BoolConst(val), s);
 }
 
+void bool_const_class::code_value(ostream &s, Environment &env)
+{
+  emit_load_imm(ACC, val, s);
+}
+
 void new__class::code(ostream &s, Environment &env)
 {
   if (type_name != SELF_TYPE)
   {
-    emit_load_address(ACC, (char *)(std::string(type_name->get_string()) + PROTOBJ_SUFFIX).c_str(), s);
-    emit_jal("Object.copy", s);
-    emit_jal((char *)(std::string(type_name->get_string()) + CLASSINIT_SUFFIX).c_str(), s);
+    emit_allocate(type_name, 0, s, env);
+    if (!cgen_optimize || has_initializers(class_map.at(type_name)))
+    {
+      emit_jal((char *)(std::string(type_name->get_string()) + CLASSINIT_SUFFIX).c_str(), s);
+    }
     return;
   }
 
+  // The prototype and initializer of the class of self are the two
+  // words at 8 * tag in class_objTab.
+  emit_load(T2, TAG_OFFSET, SELF, s);
+  emit_sll(T2, T2, 3, s);
   emit_load_address(T1, CLASSOBJTAB, s);
-  // t2 = self.tag
-  emit_load(T2, 0, SELF, s);
-
-  // t2 = offset
-  emit_load_imm(T3, 8, s);
-  emit_mul(T2, T3, T2, s);
-
-  emit_add(T2, T2, T1, s);
-
-  emit_load(T1, 0, T2, s);
-  emit_push(T1, s);
-  env.push_stack_symbol(No_type);
-  emit_move(ACC, T1, s);
+  emit_addu(T2, T2, T1, s);
+  emit_load(ACC, 0, T2, s);
+  emit_load(T1, 1, T2, s);
+  int offset = env.push_stack_symbol(No_type);
+  emit_store(T1, offset, frame_base(env), s);
 
   emit_jal("Object.copy", s);
-  emit_addiu(SP, SP, 4, s);
-  emit_load(T1, 0, SP, s);
-
-  emit_load(T1, 1, T1, s);
+  emit_load(T1, offset, frame_base(env), s);
+  env.pop_stack_symbol();
   emit_jalr(T1, s);
 }
 
 void isvoid_class::code(ostream &s, Environment &env)
 {
   e1->code(s, env);
-  emit_move(T1, ACC, s);
-  emit_load_bool(ACC, BoolConst(1), s);
-  emit_beq(T1, ZERO, label_num, s);
-  emit_load_bool(ACC, BoolConst(0), s);
-  emit_label_def(label_num++, s);
+  emit_is_zero(true, s, env);
+}
+
+void isvoid_class::code_value(ostream &s, Environment &env)
+{
+  e1->code(s, env);
+  emit_is_zero(false, s, env);
 }
 
 void no_expr_class::code(ostream &s, Environment &env)
@@ -1712,16 +3271,33 @@ void no_expr_class::code(ostream &s, Environment &env)
 void object_class::code(ostream &s, Environment &env)
 {
   int pos;
-  pos = env.get_let_var_pos_rev(name);
-  if (pos != -1)
+  char *reg;
+  bool unboxed;
+  if (env.lookup_local(name, &reg, &unboxed))
+  {
+    if (reg)
+    {
+      emit_move(ACC, reg, s);
+    }
+    else
+    {
+      emit_load(ACC, env.get_slot_offset(name), frame_base(env), s);
+    }
+    if (unboxed)
+    {
+      emit_box(type, s, env);
+    }
+    return;
+  }
+  if ((reg = env.get_arg_reg(name)))
   {
-    emit_load(ACC, pos + 1, SP, s);
+    emit_move(ACC, reg, s);
     return;
   }
   pos = env.get_arg_pos(name);
   if (pos != -1)
   {
-    emit_load(ACC, 2 + env.get_mth_args_size() - pos, FP, s);
+    emit_load(ACC, env.get_arg_offset(pos), frame_base(env), s);
     return;
   }
   pos = env.get_cls_attr_pos(name);
@@ -1733,31 +3309,123 @@ void object_class::code(ostream &s, Environment &env)
   emit_move(ACC, SELF, s);
 }
 
+void object_class::code_value(ostream &s, Environment &env)
+{
+  char *reg;
+  bool unboxed;
+  if (!env.lookup_local(name, &reg, &unboxed) || !unboxed)
+  {
+    Expression_class::code_value(s, env);
+    return;
+  }
+
+  if (reg)
+  {
+    emit_move(ACC, reg, s);
+  }
+  else
+  {
+    emit_load(ACC, env.get_slot_offset(name), frame_base(env), s);
+  }
+}
+
+//
+// Under -O a method that calls nothing and keeps nothing in the saved
+// registers is emitted without a frame.  Its slots are below SP, where
+// nothing else writes while it runs, its arguments are addressed from
+// SP, and the caller's self waits in V1, which only the runtime uses.
+// Whether the body calls out is only known once it is emitted, so it is
+// emitted here on trial and thrown away if it does.  Returns whether the
+// method was emitted.
+//
+static bool emit_leaf_method(method_class *method, ostream &s, Environment &env)
+{
+  std::ostringstream body;
+  env.set_leaf(true);
+  env.start_frame(0);
+  env.set_method(method, env.new_label(), {});
+  method->expr->code(body, env);
+  env.set_leaf(false);
+  if (calls_out(body.str()))
+  {
+    env.clear_abort_stubs();
+    return false;
+  }
+
+  std::string code = number_values(body.str());
+  bool uses_self = code.find(SELF) != std::string::npos;
+  if (uses_self)
+  {
+    emit_move(V1, SELF, s);
+    emit_move(SELF, ACC, s);
+  }
+  s << code;
+  if (uses_self)
+  {
+    emit_move(SELF, V1, s);
+  }
+  if (env.get_mth_args_size() > 0)
+  {
+    emit_addiu(SP, SP, env.get_mth_args_size() * 4, s);
+  }
+  emit_return(s);
+  emit_abort_stubs(s, env);
+  return true;
+}
+
 void method_class::code(ostream &s, Environment &env)
 {
   emit_method_ref(env.get_cls()->get_name(), name, s);
   s << LABEL;
-  emit_addiu(SP, SP, -12, s);
-  emit_store(FP, 3, SP, s);
-  emit_store(SELF, 2, SP, s);
-  emit_store(RA, 1, SP, s);
-  emit_addiu(FP, SP, 4, s);
-  emit_move(SELF, ACC, s);
-
+  std::string label_prefix = std::string(env.get_cls()->get_name()->get_string()) +
+                             METHOD_SEP + name->get_string();
+  env.set_label_prefix(label_prefix);
+  allocate_registers(formals, {expr}, env);
   for (int i = formals->first(); formals->more(i); i = formals->next(i))
   {
-    auto formal = formals->nth(i);
-    env.add_mth_arg(formal);
+    env.add_mth_arg(formals->nth(i));
   }
+  const std::vector<char *> &saved = env.get_saved_regs();
 
-  expr->code(s, env);
+  if (cgen_optimize && saved.empty())
+  {
+    if (emit_leaf_method(this, s, env))
+    {
+      env.clear_mth_args();
+      return;
+    }
+    env.set_label_prefix(label_prefix);
+  }
+
+  // The body is emitted first, as the frame is sized by the slots it
+  // takes.
+  std::ostringstream body;
+  std::set<tree_node *> tail_calls;
+  if (cgen_optimize)
+  {
+    find_tail_calls(expr, tail_calls);
+  }
+  env.start_frame(saved.size() + has_stack_maps());
+  env.set_method(this, env.new_label(), tail_calls);
+  if (!tail_calls.empty())
+  {
+    emit_label_def(env.get_body_label(), body);
+  }
+  emit_move(SELF, ACC, body);
+  for (int i = formals->first(); formals->more(i); i = formals->next(i))
+  {
+    char *reg = env.get_arg_reg(formals->nth(i)->get_name());
+    if (reg)
+    {
+      emit_load(reg, env.get_arg_offset(i), FP, body);
+    }
+  }
+  expr->code(body, env);
 
-  emit_move(SP, FP, s);
-  emit_load(RA, 0, SP, s);
-  emit_load(SELF, 1, SP, s);
-  emit_load(FP, 2, SP, s);
-  emit_addiu(SP, SP, 8, s);
-  emit_addiu(SP, SP, env.get_mth_args_size() * 4, s);
+  emit_frame_entry(saved, env.get_frame_slots(), s);
+  s << (cgen_optimize ? number_values(body.str()) : body.str());
+  emit_frame_exit(saved, env.get_mth_args_size(), s);
   env.clear_mth_args();
   emit_return(s);
+  emit_abort_stubs(s, env);
 }
@@ -1,5 +1,8 @@
 #include <assert.h>
 #include <stdio.h>
+#include <map>
+#include <set>
+#include <vector>
 #include "emit.h"
 #include "cool-tree.h"
 #include "symtab.h"
@@ -26,6 +29,7 @@ private:
    int stringclasstag;
    int intclasstag;
    int boolclasstag;
+   std::set<std::pair<Symbol, Symbol>> dead_methods;
 
    // The following methods emit code for
    // constants and global declarations.
@@ -33,6 +37,7 @@ private:
    void code_global_data();
    void code_global_text();
    void code_bools(int);
+   void code_int_cache();
    void code_select_gc();
    void code_constants();
 
@@ -42,8 +47,12 @@ private:
    void code_dispatch_tables();
    void code_prototypes();
 
-   void code_initializer();
-   void code_methods();
+   void build_feature_tables();
+   void prune_unreachable();
+
+   void code_initializer(Class_ cls, ostream &s, ostream &maps);
+   void code_methods(Class_ cls, ostream &s, ostream &maps);
+   void code_class_text(ostream &s, ostream &maps);
 
    // The following creates an inheritance graph from
    // a list of classes.  The graph is implemented as
@@ -91,4 +100,56 @@ public:
    BoolConst(int);
    void code_def(ostream &, int boolclasstag);
    void code_ref(ostream &) const;
-};
\ No newline at end of file
+};
+extern std::map<Symbol, Class_> class_map;
+extern std::vector<Class_> cls_ordered;
+
+void get_subexpressions(Expression e, std::vector<Expression> &subs);
+bool is_subclass(Symbol sub, Symbol super);
+Class_ find_method_impl(Symbol cls, Symbol name, method_class **method);
+bool is_unboxed_type(Symbol type);
+bool has_unboxed_operands(Expression e);
+bool unbox_binding(let_class *let);
+bool is_builtin_load(Class_ impl, Symbol name);
+bool may_call(Expression e);
+bool is_assigned(Symbol name, Expression e);
+bool is_used(Symbol name, Expression e);
+void find_tail_calls(Expression e, std::set<tree_node *> &calls);
+void analyze_hierarchy(const std::set<std::pair<Symbol, Symbol>> &dead_methods);
+Class_ unique_method_impl(Symbol type, Symbol name);
+void infer_types();
+Class_ inferred_method_impl(dispatch_class *site, Symbol *receiver);
+bool case_branch_is_taken(typcase_class *site, int i);
+void share_inferred_types(tree_node *site, tree_node *copy);
+bool is_basic_class(Symbol name);
+void allocate_registers(Formals formals, const std::vector<Expression> &bodies, Environment &env);
+std::string number_values(const std::string &code);
+void optimize_program(Classes classes);
+void inline_methods();
+void replace_allocations();
+void hoist_invariants();
+
+//
+// Whole-program reachability from Main_init and Main.main (see
+// cgen_analysis.cc).  Methods are identified by the class that
+// defines them and their name.
+//
+class Reachability
+{
+private:
+   std::set<Symbol> instantiated;
+   std::set<Symbol> live_classes;
+   std::set<std::pair<Symbol, Symbol>> live_methods;
+   std::set<std::pair<Symbol, Symbol>> dispatch_sites;
+   std::vector<std::pair<Class_, Expression>> pending;
+
+   void instantiate(Symbol cls);
+   void keep(Symbol cls);
+   void reach_method(Symbol cls, Symbol name);
+   void scan(Class_ cls, Expression e);
+
+public:
+   void analyze();
+   bool class_is_live(Symbol cls);
+   bool method_is_live(Symbol cls, Symbol name);
+};
@@ -0,0 +1,1110 @@
+//**************************************************************
+//
+// Whole-program analyses used by the code generator.
+//
+// These run over the typed AST after the inheritance graph and
+// the per-class method/attribute tables have been built, and
+// before any code is emitted.
+//
+//**************************************************************
+
+#include "cgen.h"
+#include <chrono>
+#include <mutex>
+
+extern Symbol Bool, Int, IO, length, Main, main_meth, No_class, Object, SELF_TYPE, Str, self,
+    type_name;
+extern int cgen_debug;
+
+//
+// The expressions nested directly in `e', in evaluation order.
+//
+void get_subexpressions(Expression e, std::vector<Expression> &subs)
+{
+  if (auto a = dynamic_cast<assign_class *>(e))
+  {
+    subs.push_back(a->expr);
+  }
+  else if (auto d = dynamic_cast<static_dispatch_class *>(e))
+  {
+    for (int i = d->actual->first(); d->actual->more(i); i = d->actual->next(i))
+      subs.push_back(d->actual->nth(i));
+    subs.push_back(d->expr);
+  }
+  else if (auto d = dynamic_cast<dispatch_class *>(e))
+  {
+    for (int i = d->actual->first(); d->actual->more(i); i = d->actual->next(i))
+      subs.push_back(d->actual->nth(i));
+    subs.push_back(d->expr);
+  }
+  else if (auto c = dynamic_cast<cond_class *>(e))
+  {
+    subs.push_back(c->pred);
+    subs.push_back(c->then_exp);
+    subs.push_back(c->else_exp);
+  }
+  else if (auto l = dynamic_cast<loop_class *>(e))
+  {
+    subs.push_back(l->pred);
+    subs.push_back(l->body);
+  }
+  else if (auto t = dynamic_cast<typcase_class *>(e))
+  {
+    subs.push_back(t->expr);
+    for (int i = t->cases->first(); t->cases->more(i); i = t->cases->next(i))
+      subs.push_back(t->cases->nth(i)->get_expr());
+  }
+  else if (auto b = dynamic_cast<block_class *>(e))
+  {
+    for (int i = b->body->first(); b->body->more(i); i = b->body->next(i))
+      subs.push_back(b->body->nth(i));
+  }
+  else if (auto l = dynamic_cast<let_class *>(e))
+  {
+    subs.push_back(l->init);
+    subs.push_back(l->body);
+  }
+  else if (auto x = dynamic_cast<plus_class *>(e))
+  {
+    subs.push_back(x->e1);
+    subs.push_back(x->e2);
+  }
+  else if (auto x = dynamic_cast<sub_class *>(e))
+  {
+    subs.push_back(x->e1);
+    subs.push_back(x->e2);
+  }
+  else if (auto x = dynamic_cast<mul_class *>(e))
+  {
+    subs.push_back(x->e1);
+    subs.push_back(x->e2);
+  }
+  else if (auto x = dynamic_cast<divide_class *>(e))
+  {
+    subs.push_back(x->e1);
+    subs.push_back(x->e2);
+  }
+  else if (auto x = dynamic_cast<lt_class *>(e))
+  {
+    subs.push_back(x->e1);
+    subs.push_back(x->e2);
+  }
+  else if (auto x = dynamic_cast<eq_class *>(e))
+  {
+    subs.push_back(x->e1);
+    subs.push_back(x->e2);
+  }
+  else if (auto x = dynamic_cast<leq_class *>(e))
+  {
+    subs.push_back(x->e1);
+    subs.push_back(x->e2);
+  }
+  else if (auto x = dynamic_cast<neg_class *>(e))
+  {
+    subs.push_back(x->e1);
+  }
+  else if (auto x = dynamic_cast<comp_class *>(e))
+  {
+    subs.push_back(x->e1);
+  }
+  else if (auto x = dynamic_cast<isvoid_class *>(e))
+  {
+    subs.push_back(x->e1);
+  }
+}
+
+bool is_subclass(Symbol sub, Symbol super)
+{
+  for (Symbol c = sub; c != No_class; c = class_map.at(c)->get_parent())
+  {
+    if (c == super)
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+//
+// The class whose definition of method `name' is used by objects of
+// class `cls', or NULL if there is none.
+//
+Class_ find_method_impl(Symbol cls, Symbol name, method_class **method)
+{
+  Class_ c = class_map.at(cls);
+  for (auto &m : c->all_methods)
+  {
+    if (m.second->get_name() == name)
+    {
+      if (method)
+      {
+        *method = m.second;
+      }
+      return m.first;
+    }
+  }
+  return NULL;
+}
+
+//
+// Ints and Bools are kept as machine integers where they do not escape.
+//
+bool is_unboxed_type(Symbol type)
+{
+  return type == Int || type == Bool;
+}
+
+//
+// Whether `e' is an operator that works on the machine integers of its
+// operands: arithmetic, comparisons and `=' on Ints or Bools.
+//
+bool has_unboxed_operands(Expression e)
+{
+  if (auto x = dynamic_cast<eq_class *>(e))
+  {
+    return is_unboxed_type(x->e1->get_type());
+  }
+  return dynamic_cast<plus_class *>(e) || dynamic_cast<sub_class *>(e) ||
+         dynamic_cast<mul_class *>(e) || dynamic_cast<divide_class *>(e) ||
+         dynamic_cast<lt_class *>(e) || dynamic_cast<leq_class *>(e);
+}
+
+namespace
+{
+
+//
+// Tallies, for the binding of `name', the objects created by keeping it
+// unboxed (`boxes', a read where an object is needed) and the objects
+// saved by doing so (`saves', the result of an operator stored in it), with
+// code in loops counted as running ten times per enclosing loop.
+//
+struct BindingUses
+{
+  Symbol name;
+  int boxes = 0;
+  int saves = 0;
+
+  void count(Expression e, bool boxed, int frequency);
+};
+
+bool is_arithmetic(Expression e)
+{
+  return dynamic_cast<plus_class *>(e) || dynamic_cast<sub_class *>(e) ||
+         dynamic_cast<mul_class *>(e) || dynamic_cast<divide_class *>(e) ||
+         dynamic_cast<neg_class *>(e);
+}
+
+// Operators whose Int or Bool result is computed unboxed.
+bool is_operator(Expression e)
+{
+  return is_arithmetic(e) || dynamic_cast<lt_class *>(e) || dynamic_cast<leq_class *>(e) ||
+         dynamic_cast<eq_class *>(e) || dynamic_cast<comp_class *>(e) ||
+         dynamic_cast<isvoid_class *>(e);
+}
+
+//
+// `boxed' tells whether `e' is evaluated to an object or to its machine
+// integer, as the code generator does.
+//
+void BindingUses::count(Expression e, bool boxed, int frequency)
+{
+  if (auto o = dynamic_cast<object_class *>(e))
+  {
+    if (o->name == name && boxed)
+    {
+      boxes += frequency;
+    }
+    return;
+  }
+  if (auto a = dynamic_cast<assign_class *>(e))
+  {
+    if (a->name != name)
+    {
+      count(a->expr, true, frequency);
+      return;
+    }
+    if (is_operator(a->expr))
+    {
+      saves += frequency;
+    }
+    if (boxed)
+    {
+      boxes += frequency;
+    }
+    count(a->expr, false, frequency);
+    return;
+  }
+  if (auto l = dynamic_cast<let_class *>(e))
+  {
+    count(l->init, !unbox_binding(l), frequency);
+    if (l->identifier != name)
+    {
+      count(l->body, boxed, frequency);
+    }
+    return;
+  }
+  if (auto t = dynamic_cast<typcase_class *>(e))
+  {
+    count(t->expr, true, frequency);
+    for (int i = t->cases->first(); t->cases->more(i); i = t->cases->next(i))
+    {
+      if (t->cases->nth(i)->get_name() != name)
+      {
+        count(t->cases->nth(i)->get_expr(), boxed, frequency);
+      }
+    }
+    return;
+  }
+  if (auto c = dynamic_cast<cond_class *>(e))
+  {
+    count(c->pred, false, frequency);
+    count(c->then_exp, boxed, frequency);
+    count(c->else_exp, boxed, frequency);
+    return;
+  }
+  if (auto l = dynamic_cast<loop_class *>(e))
+  {
+    frequency = std::min(frequency * 10, 1000000);
+    count(l->pred, false, frequency);
+    count(l->body, !is_unboxed_type(l->body->get_type()), frequency);
+    return;
+  }
+  if (auto b = dynamic_cast<block_class *>(e))
+  {
+    for (int i = b->body->first(); b->body->more(i); i = b->body->next(i))
+    {
+      Expression sub = b->body->nth(i);
+      count(sub, b->body->more(b->body->next(i)) ? !is_unboxed_type(sub->get_type()) : boxed,
+            frequency);
+    }
+    return;
+  }
+
+  // Operators on Ints and Bools evaluate their operands unboxed; anything
+  // else, such as a dispatch, needs objects.
+  bool unboxed = has_unboxed_operands(e) || is_arithmetic(e) || dynamic_cast<comp_class *>(e);
+  std::vector<Expression> subs;
+  get_subexpressions(e, subs);
+  for (Expression sub : subs)
+  {
+    count(sub, !unboxed, frequency);
+  }
+}
+
+} // namespace
+
+namespace
+{
+// The decisions of unbox_binding.  Counting the uses of a binding asks
+// about the lets nested in its body, so without them each level of
+// nesting would walk its body again.  The workers coding classes share
+// them, but the lock is never held while counting, which recurses.
+std::map<let_class *, bool> unboxed_bindings;
+std::mutex unboxed_bindings_mutex;
+} // namespace
+
+//
+// Whether the let binding `let' should hold a machine integer: it must
+// be an Int or Bool, and unboxing it must box no more values than it
+// saves from boxing.  (Boxing a Bool only picks one of two constants,
+// but is still dearer than keeping it as an object.)
+//
+bool unbox_binding(let_class *let)
+{
+  if (!is_unboxed_type(let->type_decl))
+  {
+    return false;
+  }
+  {
+    std::lock_guard<std::mutex> lock(unboxed_bindings_mutex);
+    auto it = unboxed_bindings.find(let);
+    if (it != unboxed_bindings.end())
+    {
+      return it->second;
+    }
+  }
+  BindingUses uses;
+  uses.name = let->identifier;
+  uses.saves = is_operator(let->init) ? 1 : 0;
+  uses.count(let->body, true, 1);
+  bool unboxed = uses.boxes <= uses.saves;
+  std::lock_guard<std::mutex> lock(unboxed_bindings_mutex);
+  unboxed_bindings[let] = unboxed;
+  return unboxed;
+}
+
+//
+// Whether `impl'.`name' is String.length or Object.type_name, which the
+// runtime implements as loads from the receiver.
+//
+bool is_builtin_load(Class_ impl, Symbol name)
+{
+  return impl && ((impl->get_name() == Str && name == length) ||
+                  (impl->get_name() == Object && name == type_name));
+}
+
+//
+// Whether evaluating `e' may run a method or an initializer.  Runtime
+// routines leave the unboxed temporaries alone, but Cool code may not.
+// The loads of String.length and Object.type_name are not counted.
+//
+bool may_call(Expression e)
+{
+  if (auto d = dynamic_cast<dispatch_class *>(e))
+  {
+    if (!is_builtin_load(unique_method_impl(d->expr->get_type(), d->name), d->name))
+    {
+      return true;
+    }
+  }
+  else if (auto d = dynamic_cast<static_dispatch_class *>(e))
+  {
+    if (!is_builtin_load(find_method_impl(d->type_name, d->name, NULL), d->name))
+    {
+      return true;
+    }
+  }
+  else if (dynamic_cast<new__class *>(e))
+  {
+    return true;
+  }
+  std::vector<Expression> subs;
+  get_subexpressions(e, subs);
+  for (Expression sub : subs)
+  {
+    if (may_call(sub))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+//
+// Whether `e' assigns to a variable named `name'.
+//
+bool is_assigned(Symbol name, Expression e)
+{
+  if (auto a = dynamic_cast<assign_class *>(e))
+  {
+    if (a->name == name)
+    {
+      return true;
+    }
+  }
+  std::vector<Expression> subs;
+  get_subexpressions(e, subs);
+  for (Expression sub : subs)
+  {
+    if (is_assigned(name, sub))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+//
+// Whether `e' reads or assigns a variable named `name'.
+//
+bool is_used(Symbol name, Expression e)
+{
+  if (auto o = dynamic_cast<object_class *>(e))
+  {
+    return o->name == name;
+  }
+  if (is_assigned(name, e))
+  {
+    return true;
+  }
+  std::vector<Expression> subs;
+  get_subexpressions(e, subs);
+  for (Expression sub : subs)
+  {
+    if (is_used(name, sub))
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+//
+// Add to `calls' the dispatches in tail position of `e', whose value is
+// that of `e' and after which nothing is left to do.  The body of an
+// inlined method bound to another receiver is not in tail position,
+// since self is switched back after it.
+//
+void find_tail_calls(Expression e, std::set<tree_node *> &calls)
+{
+  if (dynamic_cast<dispatch_class *>(e) || dynamic_cast<static_dispatch_class *>(e))
+  {
+    calls.insert(e);
+  }
+  else if (auto l = dynamic_cast<let_class *>(e))
+  {
+    if (l->identifier != self)
+    {
+      find_tail_calls(l->body, calls);
+    }
+  }
+  else if (auto c = dynamic_cast<cond_class *>(e))
+  {
+    find_tail_calls(c->then_exp, calls);
+    find_tail_calls(c->else_exp, calls);
+  }
+  else if (auto b = dynamic_cast<block_class *>(e))
+  {
+    find_tail_calls(b->body->nth(b->body->len() - 1), calls);
+  }
+  else if (auto t = dynamic_cast<typcase_class *>(e))
+  {
+    for (int i = t->cases->first(); t->cases->more(i); i = t->cases->next(i))
+    {
+      find_tail_calls(t->cases->nth(i)->get_expr(), calls);
+    }
+  }
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Reachability
+//
+// A rapid type analysis: the program is explored from Main_init and
+// Main.main, and only code that can run is visited.  A `new C' makes
+// C (and so its ancestors and their attribute initializers) live.  A
+// static dispatch `e@T.m' reaches the definition of m used by T.  A
+// dynamic dispatch `e.m' whose receiver has static type T reaches the
+// definition of m used by every instantiated subclass of T; sites are
+// remembered, so instantiating a class later also resolves the sites
+// seen so far.  A receiver of type SELF_TYPE is treated as having the
+// type of the enclosing class, which covers any subclass self may be.
+// `new SELF_TYPE' and copy() create objects of classes that already
+// exist, so they make nothing new live.  A class is live, and keeps its
+// tables and initializer, if it or a subclass is created or it is
+// named by a static dispatch.
+//
+//////////////////////////////////////////////////////////////////////
+
+void Reachability::analyze()
+{
+  // The runtime creates Ints, Bools and Strings itself; the basic classes
+  // are always kept since the runtime refers to their tables directly.
+  instantiate(Int);
+  instantiate(Bool);
+  instantiate(Str);
+  instantiate(Object);
+  instantiate(IO);
+
+  instantiate(Main);
+  reach_method(Main, main_meth);
+
+  while (!pending.empty())
+  {
+    std::pair<Class_, Expression> work = pending.back();
+    pending.pop_back();
+    scan(work.first, work.second);
+  }
+}
+
+void Reachability::instantiate(Symbol cls)
+{
+  if (!instantiated.insert(cls).second)
+  {
+    return;
+  }
+
+  keep(cls);
+
+  for (auto &site : dispatch_sites)
+  {
+    if (is_subclass(cls, site.first))
+    {
+      reach_method(cls, site.second);
+    }
+  }
+}
+
+//
+// Keep the tables and initializer of `cls' and its ancestors.
+//
+void Reachability::keep(Symbol cls)
+{
+  for (Symbol c = cls; c != No_class && live_classes.insert(c).second;)
+  {
+    Class_ node = class_map.at(c);
+    Features features = node->get_features();
+    for (int i = features->first(); features->more(i); i = features->next(i))
+    {
+      attr_class *attr = dynamic_cast<attr_class *>(features->nth(i));
+      if (attr && !attr->get_init()->is_empty())
+      {
+        pending.push_back(std::make_pair(node, attr->get_init()));
+      }
+    }
+    c = node->get_parent();
+  }
+}
+
+void Reachability::reach_method(Symbol cls, Symbol name)
+{
+  method_class *method = NULL;
+  Class_ impl = find_method_impl(cls, name, &method);
+  if (impl && live_methods.insert(std::make_pair(impl->get_name(), name)).second)
+  {
+    pending.push_back(std::make_pair(impl, method->expr));
+  }
+}
+
+void Reachability::scan(Class_ cls, Expression e)
+{
+  if (auto n = dynamic_cast<new__class *>(e))
+  {
+    if (n->type_name != SELF_TYPE)
+    {
+      instantiate(n->type_name);
+    }
+  }
+  else if (auto d = dynamic_cast<static_dispatch_class *>(e))
+  {
+    // The site calls T's method directly, so it is kept even if no T is
+    // ever created.
+    keep(d->type_name);
+    reach_method(d->type_name, d->name);
+  }
+  else if (auto d = dynamic_cast<dispatch_class *>(e))
+  {
+    Symbol type = d->expr->get_type();
+    if (type == SELF_TYPE)
+    {
+      type = cls->get_name();
+    }
+    if (dispatch_sites.insert(std::make_pair(type, d->name)).second)
+    {
+      for (Symbol c : instantiated)
+      {
+        if (is_subclass(c, type))
+        {
+          reach_method(c, d->name);
+        }
+      }
+    }
+  }
+
+  std::vector<Expression> subs;
+  get_subexpressions(e, subs);
+  for (Expression sub : subs)
+  {
+    scan(cls, sub);
+  }
+}
+
+bool Reachability::class_is_live(Symbol cls)
+{
+  return live_classes.count(cls) > 0;
+}
+
+bool Reachability::method_is_live(Symbol cls, Symbol name)
+{
+  return live_methods.count(std::make_pair(cls, name)) > 0;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Class hierarchy analysis
+//
+// A dispatch `e.m' whose receiver has static type T can only run a
+// definition of m used by a subclass of T.  When there is exactly one,
+// the site calls it directly instead of through the dispatch table.
+// Only the classes left after pruning unreachable code are counted, and
+// definitions that were dropped cannot be called, since no object that
+// uses them is ever created.  A receiver of type SELF_TYPE has the type
+// of the enclosing class.
+//
+//////////////////////////////////////////////////////////////////////
+
+static std::map<std::pair<Symbol, Symbol>, Class_> unique_impls;
+
+void analyze_hierarchy(const std::set<std::pair<Symbol, Symbol>> &dead_methods)
+{
+  std::map<std::pair<Symbol, Symbol>, std::set<Class_>> impls;
+  for (auto cls : cls_ordered)
+  {
+    for (auto &m : cls->all_methods)
+    {
+      Symbol name = m.second->get_name();
+      if (dead_methods.count(std::make_pair(m.first->get_name(), name)))
+      {
+        continue;
+      }
+      for (Symbol c = cls->get_name(); c != No_class; c = class_map.at(c)->get_parent())
+      {
+        impls[std::make_pair(c, name)].insert(m.first);
+      }
+    }
+  }
+
+  unique_impls.clear();
+  for (auto &entry : impls)
+  {
+    if (entry.second.size() == 1)
+    {
+      unique_impls[entry.first] = *entry.second.begin();
+    }
+  }
+}
+
+//
+// The only definition of `name' a receiver of static type `type' can
+// use, or NULL if there may be several.
+//
+Class_ unique_method_impl(Symbol type, Symbol name)
+{
+  auto it = unique_impls.find(std::make_pair(type, name));
+  return it == unique_impls.end() ? NULL : it->second;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Type inference
+//
+// A flow-insensitive 0-CFA over the reachable program: every attribute,
+// formal, let and case binding, method result and method `self' has the
+// set of classes whose objects it may hold, starting from the `new'
+// expressions and the call of Main.main, and the sets are grown until
+// nothing changes.  A dispatch on a receiver of static type T then only
+// runs the definitions used by the classes in the receiver's set, which
+// may be a single one even if T has many subclasses, and a case branch
+// that none of those classes selects is never taken.  Void is not
+// tracked: every value may also be void.  Ints, Bools and Strings are
+// also created by the runtime, so an expression of one of those static
+// types has just that class.
+//
+//////////////////////////////////////////////////////////////////////
+
+namespace
+{
+
+typedef std::set<Symbol> TypeSet;
+typedef std::pair<Symbol, Symbol> MethodKey; // defining class, name
+
+class TypeInference
+{
+public:
+  std::map<tree_node *, TypeSet> dispatch_receivers;
+  std::map<tree_node *, std::set<int>> taken_branches;
+  int iterations = 0;
+
+  void analyze();
+
+private:
+  TypeSet instantiated;
+  std::map<std::pair<Symbol, Symbol>, TypeSet> attrs; // defining class, name
+  std::map<tree_node *, TypeSet> bindings;            // formals, lets and cases
+  std::map<MethodKey, TypeSet> receivers;
+  std::map<MethodKey, TypeSet> results;
+  bool changed = false;
+
+  // The routine being analyzed.
+  Class_ cls = NULL;
+  const TypeSet *self_types = NULL;
+  std::vector<std::pair<Symbol, tree_node *>> scope;
+
+  void flow(TypeSet &into, const TypeSet &from);
+  TypeSet *variable(Symbol name);
+  void call(Symbol receiver, Symbol impl_cls, Symbol name,
+            const std::vector<TypeSet> &args, TypeSet &result);
+  TypeSet eval(Expression e);
+  TypeSet eval_node(Expression e);
+};
+
+void TypeInference::flow(TypeSet &into, const TypeSet &from)
+{
+  for (Symbol c : from)
+  {
+    if (into.insert(c).second)
+    {
+      changed = true;
+    }
+  }
+}
+
+//
+// The set of the let or case binding, formal or attribute `name' as
+// seen from the expression being analyzed.
+//
+TypeSet *TypeInference::variable(Symbol name)
+{
+  for (auto it = scope.rbegin(); it != scope.rend(); it++)
+  {
+    if (it->first == name)
+    {
+      return &bindings[it->second];
+    }
+  }
+  for (Symbol c = cls->get_name(); c != No_class; c = class_map.at(c)->get_parent())
+  {
+    Features features = class_map.at(c)->get_features();
+    for (int i = features->first(); features->more(i); i = features->next(i))
+    {
+      attr_class *attr = dynamic_cast<attr_class *>(features->nth(i));
+      if (attr && attr->get_name() == name)
+      {
+        return &attrs[std::make_pair(c, name)];
+      }
+    }
+  }
+  return NULL;
+}
+
+//
+// A call of the definition of `name' in `impl_cls' on an object of class
+// `receiver'.  The basic methods are in the runtime, and only their
+// declared result is known.
+//
+void TypeInference::call(Symbol receiver, Symbol impl_cls, Symbol name,
+                         const std::vector<TypeSet> &args, TypeSet &result)
+{
+  method_class *method = NULL;
+  Class_ impl = find_method_impl(impl_cls, name, &method);
+  if (!impl)
+  {
+    return;
+  }
+  if (is_basic_class(impl->get_name()))
+  {
+    if (method->return_type == SELF_TYPE)
+    {
+      result.insert(receiver);
+    }
+    else if (method->return_type != Object) // abort() does not return
+    {
+      result.insert(method->return_type);
+    }
+    return;
+  }
+
+  MethodKey key(impl->get_name(), name);
+  flow(receivers[key], TypeSet{receiver});
+  Formals formals = method->formals;
+  for (int i = formals->first(); formals->more(i); i = formals->next(i))
+  {
+    flow(bindings[formals->nth(i)], args[i]);
+  }
+  TypeSet &returned = results[key];
+  result.insert(returned.begin(), returned.end());
+}
+
+TypeSet TypeInference::eval(Expression e)
+{
+  TypeSet types = eval_node(e);
+  Symbol type = e->get_type();
+  if (type == Int || type == Bool || type == Str)
+  {
+    return TypeSet{type};
+  }
+  return types;
+}
+
+TypeSet TypeInference::eval_node(Expression e)
+{
+  if (auto x = dynamic_cast<object_class *>(e))
+  {
+    if (x->name == self)
+    {
+      return *self_types;
+    }
+    TypeSet *var = variable(x->name);
+    return var ? *var : TypeSet();
+  }
+  else if (auto x = dynamic_cast<assign_class *>(e))
+  {
+    TypeSet value = eval(x->expr);
+    if (TypeSet *var = variable(x->name))
+    {
+      flow(*var, value);
+    }
+    return value;
+  }
+  else if (auto x = dynamic_cast<new__class *>(e))
+  {
+    if (x->type_name == SELF_TYPE)
+    {
+      return *self_types;
+    }
+    if (instantiated.insert(x->type_name).second)
+    {
+      changed = true;
+    }
+    return TypeSet{x->type_name};
+  }
+  else if (auto x = dynamic_cast<dispatch_class *>(e))
+  {
+    std::vector<TypeSet> args;
+    for (int i = x->actual->first(); x->actual->more(i); i = x->actual->next(i))
+    {
+      args.push_back(eval(x->actual->nth(i)));
+    }
+    TypeSet receiver = eval(x->expr);
+    dispatch_receivers[x] = receiver;
+    TypeSet result;
+    for (Symbol r : receiver)
+    {
+      call(r, r, x->name, args, result);
+    }
+    return result;
+  }
+  else if (auto x = dynamic_cast<static_dispatch_class *>(e))
+  {
+    std::vector<TypeSet> args;
+    for (int i = x->actual->first(); x->actual->more(i); i = x->actual->next(i))
+    {
+      args.push_back(eval(x->actual->nth(i)));
+    }
+    TypeSet result;
+    for (Symbol r : eval(x->expr))
+    {
+      call(r, x->type_name, x->name, args, result);
+    }
+    return result;
+  }
+  else if (auto x = dynamic_cast<let_class *>(e))
+  {
+    flow(bindings[x], eval(x->init));
+    scope.push_back(std::make_pair(x->identifier, x));
+    TypeSet result = eval(x->body);
+    scope.pop_back();
+    return result;
+  }
+  else if (auto x = dynamic_cast<typcase_class *>(e))
+  {
+    // Each class selects the branch for its closest ancestor.
+    std::map<int, TypeSet> selected;
+    for (Symbol r : eval(x->expr))
+    {
+      for (Symbol c = r; c != No_class; c = class_map.at(c)->get_parent())
+      {
+        int branch = -1;
+        for (int i = x->cases->first(); x->cases->more(i); i = x->cases->next(i))
+        {
+          if (x->cases->nth(i)->get_type_decl() == c)
+          {
+            branch = i;
+          }
+        }
+        if (branch != -1)
+        {
+          selected[branch].insert(r);
+          break;
+        }
+      }
+    }
+
+    TypeSet result;
+    for (auto &entry : selected)
+    {
+      Case branch = x->cases->nth(entry.first);
+      taken_branches[x].insert(entry.first);
+      flow(bindings[branch], entry.second);
+      scope.push_back(std::make_pair(branch->get_name(), branch));
+      TypeSet types = eval(branch->get_expr());
+      scope.pop_back();
+      result.insert(types.begin(), types.end());
+    }
+    return result;
+  }
+  else if (auto x = dynamic_cast<cond_class *>(e))
+  {
+    eval(x->pred);
+    TypeSet result = eval(x->then_exp);
+    TypeSet types = eval(x->else_exp);
+    result.insert(types.begin(), types.end());
+    return result;
+  }
+  else if (auto x = dynamic_cast<block_class *>(e))
+  {
+    TypeSet result;
+    for (int i = x->body->first(); x->body->more(i); i = x->body->next(i))
+    {
+      result = eval(x->body->nth(i));
+    }
+    return result;
+  }
+
+  // Loops are void, and the rest only yield Ints and Bools.
+  std::vector<Expression> subs;
+  get_subexpressions(e, subs);
+  for (Expression sub : subs)
+  {
+    eval(sub);
+  }
+  return TypeSet();
+}
+
+void TypeInference::analyze()
+{
+  instantiated.insert(Main);
+  receivers[MethodKey(find_method_impl(Main, main_meth, NULL)->get_name(), main_meth)].insert(Main);
+
+  do
+  {
+    changed = false;
+    iterations++;
+
+    // The attribute initializers of a class run for every object of it
+    // and its subclasses.
+    for (auto &entry : class_map)
+    {
+      cls = entry.second;
+      TypeSet objects;
+      for (Symbol c : instantiated)
+      {
+        if (is_subclass(c, cls->get_name()))
+        {
+          objects.insert(c);
+        }
+      }
+      if (objects.empty() || is_basic_class(cls->get_name()))
+      {
+        continue;
+      }
+      self_types = &objects;
+      Features features = cls->get_features();
+      for (int i = features->first(); features->more(i); i = features->next(i))
+      {
+        attr_class *attr = dynamic_cast<attr_class *>(features->nth(i));
+        if (attr && !attr->get_init()->is_empty())
+        {
+          flow(attrs[std::make_pair(cls->get_name(), attr->get_name())], eval(attr->get_init()));
+        }
+      }
+    }
+
+    // Methods are only analyzed once they are called.  Calls analyzed
+    // below may add to `receivers', which is then gone over again.
+    for (auto &entry : receivers)
+    {
+      method_class *method = NULL;
+      cls = find_method_impl(entry.first.first, entry.first.second, &method);
+      self_types = &entry.second;
+      Formals formals = method->formals;
+      for (int i = formals->first(); formals->more(i); i = formals->next(i))
+      {
+        scope.push_back(std::make_pair(formals->nth(i)->get_name(), formals->nth(i)));
+      }
+      TypeSet result = eval(method->expr);
+      scope.clear();
+      flow(results[entry.first], result);
+    }
+  } while (changed);
+}
+
+TypeInference *inferred = NULL;
+
+} // namespace
+
+void infer_types()
+{
+  auto start = std::chrono::steady_clock::now();
+  static TypeInference analysis;
+  analysis.analyze();
+  inferred = &analysis;
+  auto elapsed = std::chrono::steady_clock::now() - start;
+
+  if (cgen_debug)
+  {
+    int monomorphic = 0;
+    for (auto &entry : analysis.dispatch_receivers)
+    {
+      if (inferred_method_impl(dynamic_cast<dispatch_class *>(entry.first), NULL))
+      {
+        monomorphic++;
+      }
+    }
+    int branches = 0, taken = 0;
+    for (auto &entry : analysis.taken_branches)
+    {
+      branches += dynamic_cast<typcase_class *>(entry.first)->cases->len();
+      taken += entry.second.size();
+    }
+    cerr << "inferred types in " << analysis.iterations << " iterations ("
+         << std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count()
+         << " ms): " << monomorphic << " of " << analysis.dispatch_receivers.size()
+         << " dispatch sites monomorphic, " << branches - taken << " of " << branches
+         << " case branches never taken" << endl;
+  }
+}
+
+//
+// The only definition `site' can call according to the inferred types,
+// or NULL if it may call several or the site is never reached.  If the
+// receiver is always of one class it is stored in `receiver', and
+// otherwise NULL is.
+//
+Class_ inferred_method_impl(dispatch_class *site, Symbol *receiver)
+{
+  if (receiver)
+  {
+    *receiver = NULL;
+  }
+  if (!inferred)
+  {
+    return NULL;
+  }
+  auto it = inferred->dispatch_receivers.find(site);
+  if (it == inferred->dispatch_receivers.end() || it->second.empty())
+  {
+    return NULL;
+  }
+  Class_ impl = NULL;
+  for (Symbol c : it->second)
+  {
+    Class_ c_impl = find_method_impl(c, site->name, NULL);
+    if (impl && c_impl != impl)
+    {
+      return NULL;
+    }
+    impl = c_impl;
+  }
+  if (receiver && it->second.size() == 1)
+  {
+    *receiver = *it->second.begin();
+  }
+  return impl;
+}
+
+//
+// Whether branch `i' of `site' may be taken according to the inferred
+// types.  A branch of a case that is never reached is never taken either.
+//
+bool case_branch_is_taken(typcase_class *site, int i)
+{
+  if (!inferred)
+  {
+    return true;
+  }
+  auto it = inferred->taken_branches.find(site);
+  return it != inferred->taken_branches.end() && it->second.count(i) > 0;
+}
+
+//
+// Let `copy', a copy of `site' made by the inliner, use what was inferred
+// for `site'.
+//
+void share_inferred_types(tree_node *site, tree_node *copy)
+{
+  if (!inferred)
+  {
+    return;
+  }
+  auto receivers = inferred->dispatch_receivers.find(site);
+  if (receivers != inferred->dispatch_receivers.end())
+  {
+    inferred->dispatch_receivers[copy] = receivers->second;
+  }
+  auto branches = inferred->taken_branches.find(site);
+  if (branches != inferred->taken_branches.end())
+  {
+    inferred->taken_branches[copy] = branches->second;
+  }
+}
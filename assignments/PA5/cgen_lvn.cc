@@ -0,0 +1,249 @@
+//**************************************************************
+//
+// Local value numbering over the emitted code of a routine, run
+// under -O once its body has been emitted.
+//
+// Each basic block is numbered in order: a register holds a value
+// number, and a load, an address, a constant or an arithmetic result
+// that was already computed in the block has the number it had then.
+// An instruction whose register already holds its value is dropped,
+// and one whose value is in another register becomes a move.  This
+// reuses attribute loads, dispatch table pointers, table addresses and
+// values just stored to a slot of the frame.
+//
+// Memory is either the stack, addressed from SP or FP, or the heap and
+// the tables, addressed from anything else; the two never overlap.  A
+// store forgets the loads of its kind of memory except those from the
+// same base at another offset.  A call may write any object and a
+// collection may move them all, so nothing is known after a call, nor
+// at a label or after a jump, where control may come from elsewhere.
+//
+//**************************************************************
+
+#include "cgen.h"
+#include <sstream>
+
+namespace
+{
+
+struct Instruction
+{
+  std::string op;
+  std::vector<std::string> args;
+};
+
+// Instructions that compute their first operand from the others and
+// do nothing else.
+const std::set<std::string> arithmetic = {
+    "add", "addu", "addi", "addiu", "sub", "subu", "mul", "div", "neg",
+    "and", "andi", "or", "ori", "xor", "xori", "slt", "sltu", "sll", "sra", "srl"};
+
+const std::set<std::string> branches = {
+    "beq", "bne", "beqz", "bnez", "blt", "ble", "bgt", "bge", "bltz", "blez", "bgtz", "bgez"};
+
+class ValueNumbering
+{
+private:
+  struct Memory
+  {
+    int value;
+    bool stack;
+  };
+
+  int next = 0;
+  std::map<std::string, int> regs;
+  std::map<std::string, int> values;          // la, li and arithmetic
+  std::map<std::pair<int, int>, Memory> memory; // (base, offset) of a load
+  std::ostringstream out;
+
+  int number(const std::string &reg)
+  {
+    auto it = regs.find(reg);
+    if (it != regs.end())
+    {
+      return it->second;
+    }
+    return regs[reg] = next++;
+  }
+  static bool is_stack(const std::string &base)
+  {
+    return base == SP || base == FP;
+  }
+  void forget()
+  {
+    regs.clear();
+    values.clear();
+    memory.clear();
+  }
+  void set(const std::string &dest, int value, const std::string &line);
+  void store(const Instruction &ins, const std::string &line);
+
+public:
+  void run(const std::string &line);
+  std::string result()
+  {
+    return out.str();
+  }
+};
+
+// Split "offset(base)".
+bool parse_address(const std::string &arg, int *offset, std::string *base)
+{
+  size_t open = arg.find('(');
+  if (open == std::string::npos || arg.back() != ')')
+  {
+    return false;
+  }
+  *offset = atoi(arg.substr(0, open).c_str());
+  *base = arg.substr(open + 1, arg.size() - open - 2);
+  return true;
+}
+
+//
+// Give `dest' the value computed by `line', dropping the line if `dest'
+// already holds it or copying the value from a register that does.
+//
+void ValueNumbering::set(const std::string &dest, int value, const std::string &line)
+{
+  auto it = regs.find(dest);
+  if (it != regs.end() && it->second == value)
+  {
+    return;
+  }
+  std::string holder;
+  for (auto &r : regs)
+  {
+    if (r.second == value)
+    {
+      holder = r.first;
+      break;
+    }
+  }
+  if (holder.empty())
+  {
+    out << line << "\n";
+  }
+  else
+  {
+    out << MOVE << dest << " " << holder << "\n";
+  }
+  regs[dest] = value;
+}
+
+void ValueNumbering::store(const Instruction &ins, const std::string &line)
+{
+  int offset;
+  std::string base;
+  out << line << "\n";
+  if (ins.args.size() != 2 || !parse_address(ins.args[1], &offset, &base))
+  {
+    forget();
+    return;
+  }
+  int value = number(ins.args[0]);
+  int base_value = number(base);
+  bool stack = is_stack(base);
+  for (auto it = memory.begin(); it != memory.end();)
+  {
+    bool apart = it->first.first == base_value && it->first.second != offset;
+    if (it->second.stack == stack && !apart)
+    {
+      it = memory.erase(it);
+    }
+    else
+    {
+      it++;
+    }
+  }
+  memory[{base_value, offset}] = {value, stack};
+}
+
+void ValueNumbering::run(const std::string &line)
+{
+  if (line.empty() || line[0] != '\t')
+  {
+    // A label, or anything this pass does not know.
+    forget();
+    out << line << "\n";
+    return;
+  }
+
+  Instruction ins;
+  std::istringstream fields(line);
+  fields >> ins.op;
+  for (std::string arg; fields >> arg;)
+  {
+    ins.args.push_back(arg);
+  }
+
+  int offset;
+  std::string base;
+  if (ins.op == "lw" && ins.args.size() == 2 && parse_address(ins.args[1], &offset, &base))
+  {
+    std::pair<int, int> key = {number(base), offset};
+    auto it = memory.find(key);
+    if (it != memory.end())
+    {
+      set(ins.args[0], it->second.value, line);
+    }
+    else
+    {
+      out << line << "\n";
+      int value = next++;
+      memory[key] = {value, is_stack(base)};
+      regs[ins.args[0]] = value;
+    }
+  }
+  else if (ins.op == "sw")
+  {
+    store(ins, line);
+  }
+  else if (ins.op == "move" && ins.args.size() == 2)
+  {
+    set(ins.args[0], number(ins.args[1]), line);
+  }
+  else if ((ins.op == "la" || ins.op == "li" || arithmetic.count(ins.op)) && !ins.args.empty())
+  {
+    // Operands are named by their values, so the key stays right as
+    // registers are reused.
+    std::string key = ins.op;
+    for (size_t i = 1; i < ins.args.size(); i++)
+    {
+      const std::string &arg = ins.args[i];
+      key += " " + (arg[0] == '$' ? "%" + std::to_string(number(arg)) : arg);
+    }
+    auto it = values.find(key);
+    if (it != values.end())
+    {
+      set(ins.args[0], it->second, line);
+    }
+    else
+    {
+      out << line << "\n";
+      values[key] = regs[ins.args[0]] = next++;
+    }
+  }
+  else if (branches.count(ins.op))
+  {
+    out << line << "\n";
+  }
+  else
+  {
+    // Calls, jumps and returns.
+    out << line << "\n";
+    forget();
+  }
+}
+
+} // namespace
+
+std::string number_values(const std::string &code)
+{
+  ValueNumbering numbering;
+  std::istringstream lines(code);
+  for (std::string line; std::getline(lines, line);)
+  {
+    numbering.run(line);
+  }
+  return numbering.result();
+}
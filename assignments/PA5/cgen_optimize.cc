@@ -0,0 +1,1911 @@
+//**************************************************************
+//
+// Optimizations of the typed AST, run under -O.  Constant folding
+// runs before the class table is built, and inlining, scalar
+// replacement and loop-invariant code motion once the whole-program
+// analyses are done, just before code is emitted.
+//
+//**************************************************************
+
+#include <limits.h>
+#include <algorithm>
+#include <typeinfo>
+#include "cgen.h"
+
+extern int cgen_debug;
+extern int cgen_inline_size;
+extern int cgen_inline_depth;
+extern bool guard_free;
+extern Symbol Bool, Int, No_type, Object, self, SELF_TYPE, Str, concat, length, substr;
+
+//////////////////////////////////////////////////////////////////////
+//
+// Constant folding
+//
+// Operators on constant operands are evaluated here: Int arithmetic
+// with the 32-bit wraparound of the generated code, comparisons, `not',
+// `isvoid' of an object that cannot be void, and length(), concat() and
+// substr() on String literals.  Adding or subtracting 0 and multiplying
+// or dividing by 1 leave the other operand, and a product with 0 is 0
+// when the other operand has no effects.  A let binding of a constant
+// that the body never assigns is replaced by the constant, so folding
+// carries on through its uses, and the branch of an `if' or `while'
+// whose predicate is constant is removed when it can never run.
+// Division by zero and substrings out of range are left to fail at run
+// time.  New literals are interned in `inttable' and `stringtable',
+// where code_constants finds them once they are referenced.
+//
+//////////////////////////////////////////////////////////////////////
+
+namespace
+{
+
+bool int_value(Expression e, int *v)
+{
+  auto c = dynamic_cast<int_const_class *>(e);
+  if (c)
+  {
+    *v = (int)(unsigned)strtoull(c->token->get_string(), NULL, 10);
+  }
+  return c != NULL;
+}
+
+bool bool_value(Expression e, bool *v)
+{
+  auto c = dynamic_cast<bool_const_class *>(e);
+  if (c)
+  {
+    *v = c->val;
+  }
+  return c != NULL;
+}
+
+bool string_value(Expression e, std::string *v)
+{
+  auto c = dynamic_cast<string_const_class *>(e);
+  if (c)
+  {
+    *v = c->token->get_string();
+  }
+  return c != NULL;
+}
+
+bool is_constant(Expression e)
+{
+  return dynamic_cast<int_const_class *>(e) || dynamic_cast<bool_const_class *>(e) ||
+         dynamic_cast<string_const_class *>(e);
+}
+
+// Whether evaluating `e' can have no effect but its value.
+bool is_pure(Expression e)
+{
+  return is_constant(e) || dynamic_cast<object_class *>(e) || e->is_empty();
+}
+
+Expression make_int(int v, Expression at)
+{
+  return (Expression)int_const(inttable.add_int(v))->set_type(Int)->set(at);
+}
+
+Expression make_bool(bool v, Expression at)
+{
+  return (Expression)bool_const(v)->set_type(Bool)->set(at);
+}
+
+Expression make_string(const std::string &v, Expression at)
+{
+  return (Expression)string_const(stringtable.add_string((char *)v.c_str()))
+      ->set_type(Str)
+      ->set(at);
+}
+
+Expression copy_constant(Expression c, Expression at)
+{
+  int i;
+  bool b;
+  std::string str;
+  if (int_value(c, &i))
+  {
+    return make_int(i, at);
+  }
+  if (bool_value(c, &b))
+  {
+    return make_bool(b, at);
+  }
+  string_value(c, &str);
+  return make_string(str, at);
+}
+
+class ConstantFolder
+{
+private:
+  // The constant bound to each let variable in scope that has one.
+  std::map<Symbol, Expression> constants;
+
+  Expression fold_in_scope(Symbol name, Expression value, Expression e);
+  Expressions fold_list(Expressions l);
+  Expression fold_arithmetic(Expression e, Expression &e1, Expression &e2);
+  Expression fold_comparison(Expression e, Expression &e1, Expression &e2);
+  Expression fold_string_method(dispatch_class *d);
+
+public:
+  int folded = 0;
+
+  Expression fold(Expression e);
+};
+
+//
+// Fold `e' where `name' is bound to the constant `value', or to something
+// else if `value' is NULL.
+//
+Expression ConstantFolder::fold_in_scope(Symbol name, Expression value, Expression e)
+{
+  auto outer = constants.find(name);
+  Expression saved = outer == constants.end() ? NULL : outer->second;
+  if (value)
+  {
+    constants[name] = value;
+  }
+  else
+  {
+    constants.erase(name);
+  }
+
+  e = fold(e);
+
+  if (saved)
+  {
+    constants[name] = saved;
+  }
+  else
+  {
+    constants.erase(name);
+  }
+  return e;
+}
+
+Expressions ConstantFolder::fold_list(Expressions l)
+{
+  Expressions result = nil_Expressions();
+  for (int i = l->first(); l->more(i); i = l->next(i))
+  {
+    result = append_Expressions(result, single_Expressions(fold(l->nth(i))));
+  }
+  return result;
+}
+
+Expression ConstantFolder::fold_arithmetic(Expression e, Expression &e1, Expression &e2)
+{
+  e1 = fold(e1);
+  e2 = fold(e2);
+  int a, b;
+  bool constant1 = int_value(e1, &a), constant2 = int_value(e2, &b);
+  if (!constant1 || !constant2)
+  {
+    bool plus = dynamic_cast<plus_class *>(e), mul = dynamic_cast<mul_class *>(e);
+    if ((constant1 && a == 0 && plus) || (constant1 && a == 1 && mul))
+    {
+      return e2;
+    }
+    if ((constant2 && b == 0 && !mul && !dynamic_cast<divide_class *>(e)) ||
+        (constant2 && b == 1 && !plus && !dynamic_cast<sub_class *>(e)))
+    {
+      return e1;
+    }
+    if (mul && ((constant1 && a == 0 && is_pure(e2)) || (constant2 && b == 0 && is_pure(e1))))
+    {
+      return make_int(0, e);
+    }
+    return e;
+  }
+
+  unsigned x = a, y = b;
+  if (dynamic_cast<plus_class *>(e))
+  {
+    return make_int(x + y, e);
+  }
+  if (dynamic_cast<sub_class *>(e))
+  {
+    return make_int(x - y, e);
+  }
+  if (dynamic_cast<mul_class *>(e))
+  {
+    return make_int(x * y, e);
+  }
+  if (b == 0 || (a == INT_MIN && b == -1))
+  {
+    return e;
+  }
+  return make_int(a / b, e);
+}
+
+Expression ConstantFolder::fold_comparison(Expression e, Expression &e1, Expression &e2)
+{
+  e1 = fold(e1);
+  e2 = fold(e2);
+  int a, b;
+  bool p, q;
+  std::string s, t;
+  if (int_value(e1, &a) && int_value(e2, &b))
+  {
+    if (dynamic_cast<lt_class *>(e))
+    {
+      return make_bool(a < b, e);
+    }
+    if (dynamic_cast<leq_class *>(e))
+    {
+      return make_bool(a <= b, e);
+    }
+    return make_bool(a == b, e);
+  }
+  if (bool_value(e1, &p) && bool_value(e2, &q))
+  {
+    return make_bool(p == q, e);
+  }
+  if (string_value(e1, &s) && string_value(e2, &t))
+  {
+    return make_bool(s == t, e);
+  }
+  return e;
+}
+
+//
+// String cannot be inherited from, so a dispatch on a String literal
+// calls the String method of that name.
+//
+Expression ConstantFolder::fold_string_method(dispatch_class *d)
+{
+  std::string str, arg;
+  int i, l;
+  if (!string_value(d->expr, &str))
+  {
+    return d;
+  }
+  Expressions actual = d->actual;
+  if (d->name == length && actual->len() == 0)
+  {
+    return make_int(str.size(), d);
+  }
+  if (d->name == concat && actual->len() == 1 && string_value(actual->nth(0), &arg))
+  {
+    return make_string(str + arg, d);
+  }
+  if (d->name == substr && actual->len() == 2 && int_value(actual->nth(0), &i) &&
+      int_value(actual->nth(1), &l) && i >= 0 && l >= 0 && i <= int(str.size()) &&
+      l <= int(str.size()) - i)
+  {
+    return make_string(str.substr(i, l), d);
+  }
+  return d;
+}
+
+Expression ConstantFolder::fold(Expression e)
+{
+  Expression result = e;
+  if (auto o = dynamic_cast<object_class *>(e))
+  {
+    auto it = constants.find(o->name);
+    if (it != constants.end())
+    {
+      result = copy_constant(it->second, e);
+    }
+  }
+  else if (auto a = dynamic_cast<assign_class *>(e))
+  {
+    a->expr = fold(a->expr);
+  }
+  else if (auto d = dynamic_cast<static_dispatch_class *>(e))
+  {
+    d->actual = fold_list(d->actual);
+    d->expr = fold(d->expr);
+  }
+  else if (auto d = dynamic_cast<dispatch_class *>(e))
+  {
+    d->actual = fold_list(d->actual);
+    d->expr = fold(d->expr);
+    result = fold_string_method(d);
+  }
+  else if (auto c = dynamic_cast<cond_class *>(e))
+  {
+    c->pred = fold(c->pred);
+    bool p;
+    if (bool_value(c->pred, &p))
+    {
+      result = fold(p ? c->then_exp : c->else_exp);
+    }
+    else
+    {
+      c->then_exp = fold(c->then_exp);
+      c->else_exp = fold(c->else_exp);
+    }
+  }
+  else if (auto l = dynamic_cast<loop_class *>(e))
+  {
+    l->pred = fold(l->pred);
+    bool p;
+    if (bool_value(l->pred, &p) && !p)
+    {
+      // The value of a loop is void.
+      result = (Expression)no_expr()->set_type(Object)->set(e);
+    }
+    else
+    {
+      l->body = fold(l->body);
+    }
+  }
+  else if (auto t = dynamic_cast<typcase_class *>(e))
+  {
+    t->expr = fold(t->expr);
+    for (int i = t->cases->first(); t->cases->more(i); i = t->cases->next(i))
+    {
+      branch_class *b = (branch_class *)t->cases->nth(i);
+      b->expr = fold_in_scope(b->name, NULL, b->expr);
+    }
+  }
+  else if (auto b = dynamic_cast<block_class *>(e))
+  {
+    // Expressions whose value is discarded and that do nothing are dropped.
+    Expressions body = nil_Expressions();
+    for (int i = b->body->first(); b->body->more(i); i = b->body->next(i))
+    {
+      Expression sub = fold(b->body->nth(i));
+      if (!b->body->more(b->body->next(i)) || !is_pure(sub))
+      {
+        body = append_Expressions(body, single_Expressions(sub));
+      }
+    }
+    b->body = body;
+    if (body->len() == 1)
+    {
+      result = body->nth(0);
+    }
+  }
+  else if (auto l = dynamic_cast<let_class *>(e))
+  {
+    l->init = fold(l->init);
+    if (is_constant(l->init) && l->init->get_type() == l->type_decl &&
+        !is_assigned(l->identifier, l->body))
+    {
+      // Every use of the binding is replaced, so it is no longer needed.
+      result = fold_in_scope(l->identifier, l->init, l->body);
+    }
+    else
+    {
+      l->body = fold_in_scope(l->identifier, NULL, l->body);
+    }
+  }
+  else if (auto x = dynamic_cast<plus_class *>(e))
+  {
+    result = fold_arithmetic(e, x->e1, x->e2);
+  }
+  else if (auto x = dynamic_cast<sub_class *>(e))
+  {
+    result = fold_arithmetic(e, x->e1, x->e2);
+  }
+  else if (auto x = dynamic_cast<mul_class *>(e))
+  {
+    result = fold_arithmetic(e, x->e1, x->e2);
+  }
+  else if (auto x = dynamic_cast<divide_class *>(e))
+  {
+    result = fold_arithmetic(e, x->e1, x->e2);
+  }
+  else if (auto x = dynamic_cast<lt_class *>(e))
+  {
+    result = fold_comparison(e, x->e1, x->e2);
+  }
+  else if (auto x = dynamic_cast<eq_class *>(e))
+  {
+    result = fold_comparison(e, x->e1, x->e2);
+  }
+  else if (auto x = dynamic_cast<leq_class *>(e))
+  {
+    result = fold_comparison(e, x->e1, x->e2);
+  }
+  else if (auto x = dynamic_cast<neg_class *>(e))
+  {
+    x->e1 = fold(x->e1);
+    int a;
+    if (int_value(x->e1, &a))
+    {
+      result = make_int(0u - (unsigned)a, e);
+    }
+  }
+  else if (auto x = dynamic_cast<comp_class *>(e))
+  {
+    x->e1 = fold(x->e1);
+    bool p;
+    if (bool_value(x->e1, &p))
+    {
+      result = make_bool(!p, e);
+    }
+  }
+  else if (auto x = dynamic_cast<isvoid_class *>(e))
+  {
+    x->e1 = fold(x->e1);
+    auto o = dynamic_cast<object_class *>(x->e1);
+    if (is_constant(x->e1) || (o && o->name == self))
+    {
+      result = make_bool(false, e);
+    }
+    else if (dynamic_cast<new__class *>(x->e1))
+    {
+      // The object is still created, for the effects of its initializer.
+      Expressions body = append_Expressions(single_Expressions(x->e1),
+                                            single_Expressions(make_bool(false, e)));
+      result = (Expression)block(body)->set_type(Bool)->set(e);
+    }
+  }
+
+  if (result != e)
+  {
+    folded++;
+  }
+  return result;
+}
+
+} // namespace
+
+void optimize_program(Classes classes)
+{
+  ConstantFolder folder;
+  for (int i = classes->first(); classes->more(i); i = classes->next(i))
+  {
+    Features features = classes->nth(i)->get_features();
+    for (int j = features->first(); features->more(j); j = features->next(j))
+    {
+      if (auto m = dynamic_cast<method_class *>(features->nth(j)))
+      {
+        m->expr = folder.fold(m->expr);
+      }
+      else if (auto a = dynamic_cast<attr_class *>(features->nth(j)))
+      {
+        a->init = folder.fold(a->init);
+      }
+    }
+  }
+
+  if (cgen_debug)
+    cerr << "folded " << folder.folded << " expressions" << endl;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Inlining
+//
+// A dispatch whose target is known, that is a static dispatch or a
+// dynamic one resolved by class hierarchy analysis (or by type inference
+// with -u), is replaced by a copy of the method body when that has at
+// most `cgen_inline_size' nodes.  The arguments are bound in order by
+// lets to fresh names that stand for the formals, and every binding in
+// the copy is renamed, so nothing in it can be captured by the caller.
+// On self the copy runs as it is: the object and its attributes are the
+// caller's.  On any other receiver it is wrapped in a binding of `self'
+// to the receiver, which the code generator emits by checking it for
+// void and switching $s0 to it; SELF_TYPE in the copy then means the
+// receiver's class, as it did in the method.  A site is left alone if an
+// attribute the copy uses is hidden by a binding of the caller.  The
+// copy is inlined into in turn, up to `cgen_inline_depth' levels, and
+// keeps the static type of the dispatch it replaces.  A recursive call in
+// tail position is not unrolled, since it is cheaper as a jump.
+//
+//////////////////////////////////////////////////////////////////////
+
+namespace
+{
+
+//
+// Names that cannot be written in Cool, so they clash with nothing.
+//
+Symbol fresh_name(Symbol name)
+{
+  static int fresh = 0;
+  std::string fresh_str = std::string(name->get_string()) + "." + std::to_string(fresh++);
+  return idtable.add_string((char *)fresh_str.c_str());
+}
+
+int size_of(Expression e)
+{
+  int size = 1;
+  std::vector<Expression> subs;
+  get_subexpressions(e, subs);
+  for (Expression sub : subs)
+  {
+    size += size_of(sub);
+  }
+  return size;
+}
+
+//
+// Give `copy', a copy of `e' made by copy_Expression(), the types and
+// line numbers of `e', which are not copied.
+//
+void restore(Expression e, Expression copy)
+{
+  copy->set_type(e->get_type());
+  copy->set(e);
+  share_inferred_types(e, copy);
+  std::vector<Expression> subs, copies;
+  get_subexpressions(e, subs);
+  get_subexpressions(copy, copies);
+  for (int i = 0; i < int(subs.size()); i++)
+  {
+    restore(subs[i], copies[i]);
+  }
+}
+
+class Inliner
+{
+private:
+  std::vector<Symbol> scope; // bindings of the caller visible at a site
+  Class_ cls = NULL;         // the class of self at a site
+  std::vector<method_class *> active; // the routine and the methods inlined into it
+  std::set<tree_node *> tail_calls;   // calls in tail position of the routine
+  int depth = 0;
+
+  void rename(Expression e, std::map<Symbol, Symbol> &names, std::set<Symbol> &free);
+  method_class *target(Expression site, Symbol *impl);
+  Expression expand(Expression site, Expression receiver, Expressions actual);
+  Expressions inline_list(Expressions l);
+  Expression inline_in_scope(Symbol name, Expression e);
+
+public:
+  int sites = 0;
+  int inlined = 0;
+  int copied = 0;
+
+  Expression inline_calls(Expression e);
+  void inline_routine(Class_ c, method_class *method, Formals formals, Expression &e);
+};
+
+//
+// Rename the bindings in `e' and the uses of the names in `names', and
+// collect in `free' the other names it uses, which are attributes.
+//
+void Inliner::rename(Expression e, std::map<Symbol, Symbol> &names, std::set<Symbol> &free)
+{
+  auto use = [&](Symbol &name) {
+    auto it = names.find(name);
+    if (it != names.end())
+    {
+      name = it->second;
+    }
+    else if (name != self)
+    {
+      free.insert(name);
+    }
+  };
+  auto bind = [&](Symbol &name, Expression body) {
+    if (name == self) // inlined earlier, and bound to a receiver
+    {
+      rename(body, names, free);
+      return;
+    }
+    auto outer = names.find(name);
+    Symbol saved = outer == names.end() ? NULL : outer->second;
+    Symbol old_name = name;
+    name = fresh_name(name);
+    names[old_name] = name;
+    rename(body, names, free);
+    if (saved)
+    {
+      names[old_name] = saved;
+    }
+    else
+    {
+      names.erase(old_name);
+    }
+  };
+
+  if (auto o = dynamic_cast<object_class *>(e))
+  {
+    use(o->name);
+  }
+  else if (auto a = dynamic_cast<assign_class *>(e))
+  {
+    use(a->name);
+    rename(a->expr, names, free);
+  }
+  else if (auto l = dynamic_cast<let_class *>(e))
+  {
+    rename(l->init, names, free);
+    bind(l->identifier, l->body);
+  }
+  else if (auto t = dynamic_cast<typcase_class *>(e))
+  {
+    rename(t->expr, names, free);
+    for (int i = t->cases->first(); t->cases->more(i); i = t->cases->next(i))
+    {
+      branch_class *b = (branch_class *)t->cases->nth(i);
+      bind(b->name, b->expr);
+    }
+  }
+  else
+  {
+    std::vector<Expression> subs;
+    get_subexpressions(e, subs);
+    for (Expression sub : subs)
+    {
+      rename(sub, names, free);
+    }
+  }
+}
+
+//
+// The method `site' is known to call if it is small enough to inline,
+// with the class defining it in `impl'.
+//
+method_class *Inliner::target(Expression site, Symbol *impl)
+{
+  Class_ impl_cls = NULL;
+  Symbol name;
+  if (auto d = dynamic_cast<static_dispatch_class *>(site))
+  {
+    impl_cls = find_method_impl(d->type_name, d->name, NULL);
+    name = d->name;
+  }
+  else
+  {
+    dispatch_class *dispatch = (dispatch_class *)site;
+    Symbol type = dispatch->expr->get_type();
+    impl_cls = unique_method_impl(type == SELF_TYPE ? cls->get_name() : type, dispatch->name);
+    if (!impl_cls && guard_free)
+    {
+      impl_cls = inferred_method_impl(dispatch, NULL);
+    }
+    name = dispatch->name;
+  }
+  if (!impl_cls || is_basic_class(impl_cls->get_name()))
+  {
+    return NULL;
+  }
+
+  method_class *method = NULL;
+  find_method_impl(impl_cls->get_name(), name, &method);
+  if (size_of(method->expr) > cgen_inline_size)
+  {
+    return NULL;
+  }
+  *impl = impl_cls->get_name();
+  return method;
+}
+
+//
+// The copy of the method called by `site' that replaces it, or NULL if it
+// is not inlined.  The receiver and arguments are already inlined into.
+//
+Expression Inliner::expand(Expression site, Expression receiver, Expressions actual)
+{
+  Symbol impl;
+  method_class *method = target(site, &impl);
+  if (!method || depth >= cgen_inline_depth ||
+      (tail_calls.count(site) &&
+       std::find(active.begin(), active.end(), method) != active.end()))
+  {
+    return NULL;
+  }
+
+  Expression body = method->expr->copy_Expression();
+  restore(method->expr, body);
+  std::map<Symbol, Symbol> names;
+  std::vector<Symbol> formal_names;
+  Formals formals = method->formals;
+  for (int i = formals->first(); formals->more(i); i = formals->next(i))
+  {
+    formal_names.push_back(fresh_name(formals->nth(i)->get_name()));
+    names[formals->nth(i)->get_name()] = formal_names.back();
+  }
+  std::set<Symbol> free;
+  rename(body, names, free);
+  for (Symbol name : free)
+  {
+    if (std::find(scope.begin(), scope.end(), name) != scope.end())
+    {
+      return NULL;
+    }
+  }
+
+  inlined++;
+  copied += size_of(body);
+
+  // Calls in the copy are on the receiver's self.
+  auto o = dynamic_cast<object_class *>(receiver);
+  bool on_self = o && o->name == self;
+  if (on_self && tail_calls.count(site))
+  {
+    find_tail_calls(body, tail_calls);
+  }
+  Class_ outer_cls = cls;
+  if (!on_self)
+  {
+    cls = class_map.at(impl);
+  }
+  scope.insert(scope.end(), formal_names.begin(), formal_names.end());
+  depth++;
+  active.push_back(method);
+  body = inline_calls(body);
+  active.pop_back();
+  depth--;
+  scope.resize(scope.size() - formal_names.size());
+  cls = outer_cls;
+
+  Symbol type = site->get_type();
+  if (!on_self)
+  {
+    body = (Expression)let(self, impl, receiver, body)->set_type(type)->set(site);
+  }
+  else if (formal_names.empty() && body->get_type() != type)
+  {
+    body = (Expression)block(single_Expressions(body))->set_type(type)->set(site);
+  }
+  for (int i = formal_names.size() - 1; i >= 0; i--)
+  {
+    body = (Expression)let(formal_names[i], ((formal_class *)formals->nth(i))->type_decl,
+                           actual->nth(i), body)
+               ->set_type(type)
+               ->set(site);
+  }
+  return body;
+}
+
+Expressions Inliner::inline_list(Expressions l)
+{
+  Expressions result = nil_Expressions();
+  for (int i = l->first(); l->more(i); i = l->next(i))
+  {
+    result = append_Expressions(result, single_Expressions(inline_calls(l->nth(i))));
+  }
+  return result;
+}
+
+Expression Inliner::inline_in_scope(Symbol name, Expression e)
+{
+  scope.push_back(name);
+  e = inline_calls(e);
+  scope.pop_back();
+  return e;
+}
+
+Expression Inliner::inline_calls(Expression e)
+{
+  if (auto d = dynamic_cast<static_dispatch_class *>(e))
+  {
+    d->actual = inline_list(d->actual);
+    d->expr = inline_calls(d->expr);
+    sites++;
+    Expression copy = expand(d, d->expr, d->actual);
+    return copy ? copy : e;
+  }
+  else if (auto d = dynamic_cast<dispatch_class *>(e))
+  {
+    d->actual = inline_list(d->actual);
+    d->expr = inline_calls(d->expr);
+    sites++;
+    Expression copy = expand(d, d->expr, d->actual);
+    return copy ? copy : e;
+  }
+  else if (auto l = dynamic_cast<let_class *>(e))
+  {
+    l->init = inline_calls(l->init);
+    if (l->identifier == self)
+    {
+      Class_ outer_cls = cls;
+      cls = class_map.at(l->type_decl);
+      l->body = inline_calls(l->body);
+      cls = outer_cls;
+    }
+    else
+    {
+      l->body = inline_in_scope(l->identifier, l->body);
+    }
+  }
+  else if (auto t = dynamic_cast<typcase_class *>(e))
+  {
+    t->expr = inline_calls(t->expr);
+    for (int i = t->cases->first(); t->cases->more(i); i = t->cases->next(i))
+    {
+      branch_class *b = (branch_class *)t->cases->nth(i);
+      b->expr = inline_in_scope(b->name, b->expr);
+    }
+  }
+  else if (auto a = dynamic_cast<assign_class *>(e))
+  {
+    a->expr = inline_calls(a->expr);
+  }
+  else if (auto c = dynamic_cast<cond_class *>(e))
+  {
+    c->pred = inline_calls(c->pred);
+    c->then_exp = inline_calls(c->then_exp);
+    c->else_exp = inline_calls(c->else_exp);
+  }
+  else if (auto l = dynamic_cast<loop_class *>(e))
+  {
+    l->pred = inline_calls(l->pred);
+    l->body = inline_calls(l->body);
+  }
+  else if (auto b = dynamic_cast<block_class *>(e))
+  {
+    b->body = inline_list(b->body);
+  }
+  else if (auto x = dynamic_cast<plus_class *>(e))
+  {
+    x->e1 = inline_calls(x->e1);
+    x->e2 = inline_calls(x->e2);
+  }
+  else if (auto x = dynamic_cast<sub_class *>(e))
+  {
+    x->e1 = inline_calls(x->e1);
+    x->e2 = inline_calls(x->e2);
+  }
+  else if (auto x = dynamic_cast<mul_class *>(e))
+  {
+    x->e1 = inline_calls(x->e1);
+    x->e2 = inline_calls(x->e2);
+  }
+  else if (auto x = dynamic_cast<divide_class *>(e))
+  {
+    x->e1 = inline_calls(x->e1);
+    x->e2 = inline_calls(x->e2);
+  }
+  else if (auto x = dynamic_cast<lt_class *>(e))
+  {
+    x->e1 = inline_calls(x->e1);
+    x->e2 = inline_calls(x->e2);
+  }
+  else if (auto x = dynamic_cast<eq_class *>(e))
+  {
+    x->e1 = inline_calls(x->e1);
+    x->e2 = inline_calls(x->e2);
+  }
+  else if (auto x = dynamic_cast<leq_class *>(e))
+  {
+    x->e1 = inline_calls(x->e1);
+    x->e2 = inline_calls(x->e2);
+  }
+  else if (auto x = dynamic_cast<neg_class *>(e))
+  {
+    x->e1 = inline_calls(x->e1);
+  }
+  else if (auto x = dynamic_cast<comp_class *>(e))
+  {
+    x->e1 = inline_calls(x->e1);
+  }
+  else if (auto x = dynamic_cast<isvoid_class *>(e))
+  {
+    x->e1 = inline_calls(x->e1);
+  }
+  return e;
+}
+
+void Inliner::inline_routine(Class_ c, method_class *method, Formals formals, Expression &e)
+{
+  cls = c;
+  active.assign(1, method);
+  tail_calls.clear();
+  find_tail_calls(e, tail_calls);
+  for (int i = formals->first(); formals->more(i); i = formals->next(i))
+  {
+    scope.push_back(formals->nth(i)->get_name());
+  }
+  e = inline_calls(e);
+  scope.clear();
+}
+
+} // namespace
+
+void inline_methods()
+{
+  if (cgen_inline_size <= 0 || cgen_inline_depth <= 0)
+  {
+    return;
+  }
+  Inliner inliner;
+  for (auto cls : cls_ordered)
+  {
+    if (is_basic_class(cls->get_name()))
+    {
+      continue;
+    }
+    Features features = cls->get_features();
+    for (int j = features->first(); features->more(j); j = features->next(j))
+    {
+      if (auto m = dynamic_cast<method_class *>(features->nth(j)))
+      {
+        inliner.inline_routine(cls, m, m->formals, m->expr);
+      }
+      else if (auto a = dynamic_cast<attr_class *>(features->nth(j)))
+      {
+        inliner.inline_routine(cls, NULL, nil_Formals(), a->init);
+      }
+    }
+  }
+
+  if (cgen_debug)
+    cerr << "inlined " << inliner.inlined << " of " << inliner.sites << " calls ("
+         << inliner.copied << " expressions copied)" << endl;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Scalar replacement
+//
+// An object made by `new' that is never seen outside the code around
+// it is replaced by its attributes, which become lets of fresh names.
+// Once its methods are inlined the object is mostly the receiver of the
+// copies: their bindings of `self' to it are dropped, and the attributes
+// they use renamed to the lets.  It may also be bound to other names,
+// which alias it, and `isvoid' of it and `=' with it are folded, since
+// nothing else can refer to it.  It escapes if it is stored, passed,
+// dispatched or cased on, or is the value of the code around it where
+// that is used.  The code around it is the outermost let whose
+// initializer makes it outside of a loop, so it is made at most once
+// each time the let runs, and only classes whose attributes start as
+// constants are replaced, so their initialization can move to the
+// lets.  The attributes are then locals like any other: in a register
+// or the frame, where the garbage collector finds what they point to,
+// or unboxed if they are Ints or Bools.  A call that is not inlined
+// gets the object itself, so its class is not looked into.
+//
+//////////////////////////////////////////////////////////////////////
+
+namespace
+{
+
+// Whether a value is the object being replaced.
+enum Identity
+{
+  NOT_OBJECT,
+  IS_OBJECT,
+  MAY_BE_OBJECT
+};
+
+Identity either(Identity a, Identity b)
+{
+  return a == b ? a : MAY_BE_OBJECT;
+}
+
+bool is_replaceable(new__class *n)
+{
+  auto it = class_map.find(n->type_name);
+  if (n->type_name == SELF_TYPE || it == class_map.end() || is_basic_class(n->type_name))
+  {
+    return false;
+  }
+  for (auto attr : it->second->all_attrs)
+  {
+    if (attr->type_decl == SELF_TYPE || !(attr->init->is_empty() || is_constant(attr->init)))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+//
+// Add to `allocations' the replaceable objects that `e' makes at most
+// once each time it runs.
+//
+void find_allocations(Expression e, std::vector<new__class *> &allocations)
+{
+  if (auto n = dynamic_cast<new__class *>(e))
+  {
+    if (is_replaceable(n))
+    {
+      allocations.push_back(n);
+    }
+  }
+  else if (!dynamic_cast<loop_class *>(e))
+  {
+    std::vector<Expression> subs;
+    get_subexpressions(e, subs);
+    for (Expression sub : subs)
+    {
+      find_allocations(sub, allocations);
+    }
+  }
+}
+
+int count_allocations(Expression e)
+{
+  auto n = dynamic_cast<new__class *>(e);
+  int count = n && !is_basic_class(n->type_name);
+  std::vector<Expression> subs;
+  get_subexpressions(e, subs);
+  for (Expression sub : subs)
+  {
+    count += count_allocations(sub);
+  }
+  return count;
+}
+
+//
+// The expressions `l' in order, as one of the type of `at'.  Those
+// without code are left out.
+//
+Expression sequence(const std::vector<Expression> &l, Expression at)
+{
+  Expressions body = nil_Expressions();
+  for (int i = 0; i < int(l.size()); i++)
+  {
+    if (i == int(l.size()) - 1 || !l[i]->is_empty())
+    {
+      body = append_Expressions(body, single_Expressions(l[i]));
+    }
+  }
+  if (body->len() == 1 && body->nth(0)->get_type() == at->get_type())
+  {
+    return body->nth(0);
+  }
+  return (Expression)block(body)->set_type(at->get_type())->set(at);
+}
+
+class ScalarReplacer
+{
+private:
+  std::vector<std::pair<Symbol, bool>> scope; // bindings, and whether each is the object
+  bool self_is_object = false;
+  new__class *object = NULL;       // the allocation being replaced
+  std::map<Symbol, Symbol> fields; // its attributes and the names replacing them
+  bool escapes = false;
+
+  template <class F>
+  auto in_scope(Symbol name, bool is_object, F f) -> decltype(f())
+  {
+    bool outer_self = self_is_object;
+    if (name == self)
+    {
+      self_is_object = is_object;
+    }
+    else
+    {
+      scope.push_back({name, is_object});
+    }
+    auto result = f();
+    if (name == self)
+    {
+      self_is_object = outer_self;
+    }
+    else
+    {
+      scope.pop_back();
+    }
+    return result;
+  }
+
+  bool refers_to_object(Symbol name);
+  Symbol field(Symbol name);
+  Identity identity(Expression e);
+  void value(Expression e);
+  Expression empty(Expression e);
+  Expressions replace_list(Expressions l);
+  Expression replace_allocation(let_class *l, bool discarded);
+  Expression replace(Expression e, bool discarded);
+
+public:
+  int allocations = 0;
+  int replaced = 0;
+
+  void replace_routine(Formals formals, Expression &e);
+};
+
+bool ScalarReplacer::refers_to_object(Symbol name)
+{
+  if (name == self)
+  {
+    return self_is_object;
+  }
+  for (auto it = scope.rbegin(); it != scope.rend(); it++)
+  {
+    if (it->first == name)
+    {
+      return it->second;
+    }
+  }
+  return false;
+}
+
+//
+// The name replacing the attribute `name' refers to, or NULL if it is
+// not one of the object's.
+//
+Symbol ScalarReplacer::field(Symbol name)
+{
+  if (!self_is_object)
+  {
+    return NULL;
+  }
+  for (auto &binding : scope)
+  {
+    if (binding.first == name)
+    {
+      return NULL;
+    }
+  }
+  auto it = fields.find(name);
+  return it == fields.end() ? NULL : it->second;
+}
+
+//
+// Whether the value of `e' is the object, noting in `escapes' any use
+// of it that keeps it from being replaced.
+//
+Identity ScalarReplacer::identity(Expression e)
+{
+  if (e == object)
+  {
+    return IS_OBJECT;
+  }
+  if (auto n = dynamic_cast<new__class *>(e))
+  {
+    if (n->type_name == SELF_TYPE && self_is_object)
+    {
+      escapes = true;
+    }
+  }
+  else if (auto o = dynamic_cast<object_class *>(e))
+  {
+    return refers_to_object(o->name) ? IS_OBJECT : NOT_OBJECT;
+  }
+  else if (auto a = dynamic_cast<assign_class *>(e))
+  {
+    value(a->expr);
+    if (refers_to_object(a->name))
+    {
+      escapes = true;
+    }
+  }
+  else if (auto l = dynamic_cast<let_class *>(e))
+  {
+    Identity init = identity(l->init);
+    if (init == MAY_BE_OBJECT || (l->type_decl == SELF_TYPE && self_is_object))
+    {
+      escapes = true;
+    }
+    return in_scope(l->identifier, init == IS_OBJECT, [&] { return identity(l->body); });
+  }
+  else if (auto t = dynamic_cast<typcase_class *>(e))
+  {
+    value(t->expr);
+    Identity result = NOT_OBJECT;
+    for (int i = t->cases->first(); t->cases->more(i); i = t->cases->next(i))
+    {
+      branch_class *b = (branch_class *)t->cases->nth(i);
+      Identity branch = in_scope(b->name, false, [&] { return identity(b->expr); });
+      result = i == t->cases->first() ? branch : either(result, branch);
+    }
+    return result;
+  }
+  else if (auto c = dynamic_cast<cond_class *>(e))
+  {
+    value(c->pred);
+    return either(identity(c->then_exp), identity(c->else_exp));
+  }
+  else if (auto b = dynamic_cast<block_class *>(e))
+  {
+    Identity last = NOT_OBJECT;
+    for (int i = b->body->first(); b->body->more(i); i = b->body->next(i))
+    {
+      last = identity(b->body->nth(i));
+    }
+    return last;
+  }
+  else if (auto l = dynamic_cast<loop_class *>(e))
+  {
+    value(l->pred);
+    identity(l->body);
+  }
+  else if (auto x = dynamic_cast<isvoid_class *>(e))
+  {
+    if (identity(x->e1) == MAY_BE_OBJECT)
+    {
+      escapes = true;
+    }
+  }
+  else if (auto x = dynamic_cast<eq_class *>(e))
+  {
+    if (identity(x->e1) == MAY_BE_OBJECT || identity(x->e2) == MAY_BE_OBJECT)
+    {
+      escapes = true;
+    }
+  }
+  else
+  {
+    std::vector<Expression> subs;
+    get_subexpressions(e, subs);
+    for (Expression sub : subs)
+    {
+      value(sub);
+    }
+  }
+  return NOT_OBJECT;
+}
+
+// `e' is used for its value, which must not be the object.
+void ScalarReplacer::value(Expression e)
+{
+  if (identity(e) != NOT_OBJECT)
+  {
+    escapes = true;
+  }
+}
+
+// What is left of a use of the object whose value is not needed.
+Expression ScalarReplacer::empty(Expression e)
+{
+  return (Expression)no_expr()->set_type(No_type)->set(e);
+}
+
+Expressions ScalarReplacer::replace_list(Expressions l)
+{
+  Expressions result = nil_Expressions();
+  for (int i = l->first(); l->more(i); i = l->next(i))
+  {
+    result = append_Expressions(result, single_Expressions(replace(l->nth(i), false)));
+  }
+  return result;
+}
+
+//
+// `l' with an object made in its initializer replaced by lets of its
+// attributes around it, or NULL if every such object escapes.  The
+// result is searched again for the other objects.
+//
+Expression ScalarReplacer::replace_allocation(let_class *l, bool discarded)
+{
+  std::vector<new__class *> allocations;
+  find_allocations(l->init, allocations);
+  for (new__class *n : allocations)
+  {
+    std::vector<attr_class *> &attrs = class_map.at(n->type_name)->all_attrs;
+    object = n;
+    for (auto attr : attrs)
+    {
+      fields[attr->name] = attr->name;
+    }
+    escapes = false;
+    Identity result = identity(l);
+    if (escapes || (result != NOT_OBJECT && !discarded))
+    {
+      object = NULL;
+      fields.clear();
+      continue;
+    }
+
+    for (auto &f : fields)
+    {
+      f.second = fresh_name(f.first);
+    }
+    Expression e = replace(l, discarded);
+    for (auto it = attrs.rbegin(); it != attrs.rend(); it++)
+    {
+      attr_class *attr = *it;
+      Expression init = attr->init->is_empty() ? empty(n) : copy_constant(attr->init, n);
+      e = (Expression)let(fields[attr->name], attr->type_decl, init, e)
+              ->set_type(l->get_type())
+              ->set(l);
+    }
+    object = NULL;
+    fields.clear();
+    replaced++;
+    return replace(e, discarded);
+  }
+  return NULL;
+}
+
+//
+// Replace the object in `e', whose value is not needed if `discarded',
+// or look for objects to replace when there is none.
+//
+Expression ScalarReplacer::replace(Expression e, bool discarded)
+{
+  if (e == object)
+  {
+    return empty(e);
+  }
+  if (auto o = dynamic_cast<object_class *>(e))
+  {
+    if (refers_to_object(o->name))
+    {
+      return empty(e);
+    }
+    if (Symbol f = field(o->name))
+    {
+      o->name = f;
+    }
+  }
+  else if (auto a = dynamic_cast<assign_class *>(e))
+  {
+    a->expr = replace(a->expr, false);
+    if (Symbol f = field(a->name))
+    {
+      a->name = f;
+    }
+  }
+  else if (auto l = dynamic_cast<let_class *>(e))
+  {
+    if (!object)
+    {
+      if (Expression replaced = replace_allocation(l, discarded))
+      {
+        return replaced;
+      }
+    }
+    bool is_object = object && identity(l->init) == IS_OBJECT;
+    l->init = replace(l->init, is_object);
+    l->body = in_scope(l->identifier, is_object, [&] { return replace(l->body, discarded); });
+    if (is_object)
+    {
+      return sequence({l->init, l->body}, l);
+    }
+  }
+  else if (auto t = dynamic_cast<typcase_class *>(e))
+  {
+    t->expr = replace(t->expr, false);
+    for (int i = t->cases->first(); t->cases->more(i); i = t->cases->next(i))
+    {
+      branch_class *b = (branch_class *)t->cases->nth(i);
+      b->expr = in_scope(b->name, false, [&] { return replace(b->expr, discarded); });
+    }
+  }
+  else if (auto c = dynamic_cast<cond_class *>(e))
+  {
+    c->pred = replace(c->pred, false);
+    c->then_exp = replace(c->then_exp, discarded);
+    c->else_exp = replace(c->else_exp, discarded);
+  }
+  else if (auto l = dynamic_cast<loop_class *>(e))
+  {
+    l->pred = replace(l->pred, false);
+    l->body = replace(l->body, true);
+  }
+  else if (auto b = dynamic_cast<block_class *>(e))
+  {
+    std::vector<Expression> body;
+    for (int i = b->body->first(); b->body->more(i); i = b->body->next(i))
+    {
+      body.push_back(replace(b->body->nth(i), b->body->more(b->body->next(i)) || discarded));
+    }
+    return sequence(body, e);
+  }
+  else if (auto x = dynamic_cast<isvoid_class *>(e))
+  {
+    if (object && identity(x->e1) == IS_OBJECT)
+    {
+      return sequence({replace(x->e1, true), make_bool(false, e)}, e);
+    }
+    x->e1 = replace(x->e1, false);
+  }
+  else if (auto x = dynamic_cast<eq_class *>(e))
+  {
+    Identity a = object ? identity(x->e1) : NOT_OBJECT;
+    Identity b = object ? identity(x->e2) : NOT_OBJECT;
+    if (a == IS_OBJECT || b == IS_OBJECT)
+    {
+      return sequence({replace(x->e1, a == IS_OBJECT), replace(x->e2, b == IS_OBJECT),
+                       make_bool(a == b, e)},
+                      e);
+    }
+    x->e1 = replace(x->e1, false);
+    x->e2 = replace(x->e2, false);
+  }
+  else if (auto d = dynamic_cast<static_dispatch_class *>(e))
+  {
+    d->actual = replace_list(d->actual);
+    d->expr = replace(d->expr, false);
+  }
+  else if (auto d = dynamic_cast<dispatch_class *>(e))
+  {
+    d->actual = replace_list(d->actual);
+    d->expr = replace(d->expr, false);
+  }
+  else if (auto x = dynamic_cast<plus_class *>(e))
+  {
+    x->e1 = replace(x->e1, false);
+    x->e2 = replace(x->e2, false);
+  }
+  else if (auto x = dynamic_cast<sub_class *>(e))
+  {
+    x->e1 = replace(x->e1, false);
+    x->e2 = replace(x->e2, false);
+  }
+  else if (auto x = dynamic_cast<mul_class *>(e))
+  {
+    x->e1 = replace(x->e1, false);
+    x->e2 = replace(x->e2, false);
+  }
+  else if (auto x = dynamic_cast<divide_class *>(e))
+  {
+    x->e1 = replace(x->e1, false);
+    x->e2 = replace(x->e2, false);
+  }
+  else if (auto x = dynamic_cast<lt_class *>(e))
+  {
+    x->e1 = replace(x->e1, false);
+    x->e2 = replace(x->e2, false);
+  }
+  else if (auto x = dynamic_cast<leq_class *>(e))
+  {
+    x->e1 = replace(x->e1, false);
+    x->e2 = replace(x->e2, false);
+  }
+  else if (auto x = dynamic_cast<neg_class *>(e))
+  {
+    x->e1 = replace(x->e1, false);
+  }
+  else if (auto x = dynamic_cast<comp_class *>(e))
+  {
+    x->e1 = replace(x->e1, false);
+  }
+  return e;
+}
+
+void ScalarReplacer::replace_routine(Formals formals, Expression &e)
+{
+  allocations += count_allocations(e);
+  for (int i = formals->first(); formals->more(i); i = formals->next(i))
+  {
+    scope.push_back({formals->nth(i)->get_name(), false});
+  }
+  e = replace(e, false);
+  scope.clear();
+}
+
+} // namespace
+
+void replace_allocations()
+{
+  ScalarReplacer replacer;
+  for (auto cls : cls_ordered)
+  {
+    if (is_basic_class(cls->get_name()))
+    {
+      continue;
+    }
+    Features features = cls->get_features();
+    for (int j = features->first(); features->more(j); j = features->next(j))
+    {
+      if (auto m = dynamic_cast<method_class *>(features->nth(j)))
+      {
+        replacer.replace_routine(m->formals, m->expr);
+      }
+      else if (auto a = dynamic_cast<attr_class *>(features->nth(j)))
+      {
+        replacer.replace_routine(nil_Formals(), a->init);
+      }
+    }
+  }
+
+  if (cgen_debug)
+    cerr << "replaced " << replacer.replaced << " of " << replacer.allocations
+         << " objects by their attributes" << endl;
+}
+
+//////////////////////////////////////////////////////////////////////
+//
+// Loop-invariant code motion
+//
+// An expression in a `while' loop that has the same value on every
+// iteration is computed once, by a let of a fresh name around the loop,
+// and the loop reads the name.  The loop may not run it at all, so only
+// what has no effect and cannot fail is moved: Int arithmetic other than
+// division, comparisons, `not', and length() of a String, which is never
+// void.  Reading an Int or Bool attribute is moved too if the loop makes
+// no calls, so the code generator can keep the value unboxed.  A local
+// is invariant if the loop neither assigns nor binds it, and so is an
+// attribute, if the loop makes no calls or no method assigns it.  Inside
+// a binding of `self' the attributes are another object's, and nothing
+// is moved from there.  Inner loops are done first, and what they move
+// out may then move again out of the loops around them.
+//
+//////////////////////////////////////////////////////////////////////
+
+namespace
+{
+
+// Every name assigned in `e', and every name bound by a let or case.
+void find_names(Expression e, std::set<Symbol> &assigned, std::set<Symbol> &bound)
+{
+  if (auto a = dynamic_cast<assign_class *>(e))
+  {
+    assigned.insert(a->name);
+  }
+  else if (auto l = dynamic_cast<let_class *>(e))
+  {
+    bound.insert(l->identifier);
+  }
+  else if (auto t = dynamic_cast<typcase_class *>(e))
+  {
+    for (int i = t->cases->first(); t->cases->more(i); i = t->cases->next(i))
+    {
+      bound.insert(((branch_class *)t->cases->nth(i))->name);
+    }
+  }
+  std::vector<Expression> subs;
+  get_subexpressions(e, subs);
+  for (Expression sub : subs)
+  {
+    find_names(sub, assigned, bound);
+  }
+}
+
+// Whether `a' and `b' are the same expression, for those that are moved.
+bool same_value(Expression a, Expression b)
+{
+  if (typeid(*a) != typeid(*b))
+  {
+    return false;
+  }
+  if (auto o = dynamic_cast<object_class *>(a))
+  {
+    return o->name == ((object_class *)b)->name;
+  }
+  if (auto c = dynamic_cast<int_const_class *>(a))
+  {
+    return c->token == ((int_const_class *)b)->token;
+  }
+  if (auto c = dynamic_cast<string_const_class *>(a))
+  {
+    return c->token == ((string_const_class *)b)->token;
+  }
+  if (auto c = dynamic_cast<bool_const_class *>(a))
+  {
+    return c->val == ((bool_const_class *)b)->val;
+  }
+  std::vector<Expression> subs_a, subs_b;
+  get_subexpressions(a, subs_a);
+  get_subexpressions(b, subs_b);
+  if (subs_a.empty() || subs_a.size() != subs_b.size())
+  {
+    return false;
+  }
+  for (size_t i = 0; i < subs_a.size(); i++)
+  {
+    if (!same_value(subs_a[i], subs_b[i]))
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+class Hoister
+{
+private:
+  // Names assigned by some method.
+  std::set<Symbol> assigned_anywhere;
+  // The locals in scope.
+  std::vector<Symbol> scope;
+
+  // A loop being worked on: what it assigns and binds, whether it calls
+  // out, how deep the code being looked at is in bindings of `self',
+  // and what has been moved out of it so far.
+  struct Loop
+  {
+    std::set<Symbol> assigned;
+    std::set<Symbol> bound;
+    bool calls;
+    int rebound;
+    std::vector<std::pair<Symbol, Expression>> moved;
+  };
+  std::vector<Loop> loops;
+
+  bool is_local(Symbol name)
+  {
+    return std::find(scope.begin(), scope.end(), name) != scope.end();
+  }
+  bool is_invariant(Expression e);
+  bool worth_moving(Expression e);
+  Expression move(Expression e);
+  Expression hoist_in_scope(Symbol name, Expression e);
+  Expressions hoist_list(Expressions l);
+  Expression hoist_loop(loop_class *l);
+
+public:
+  int moved = 0;
+  int loops_seen = 0;
+
+  Hoister();
+  Expression hoist(Expression e);
+  void hoist_routine(Formals formals, Expression &e);
+};
+
+Hoister::Hoister()
+{
+  for (auto cls : cls_ordered)
+  {
+    Features features = cls->get_features();
+    for (int i = features->first(); features->more(i); i = features->next(i))
+    {
+      if (auto m = dynamic_cast<method_class *>(features->nth(i)))
+      {
+        std::set<Symbol> bound;
+        find_names(m->expr, assigned_anywhere, bound);
+      }
+    }
+  }
+}
+
+bool Hoister::is_invariant(Expression e)
+{
+  const Loop &loop = loops.back();
+  if (dynamic_cast<int_const_class *>(e) || dynamic_cast<bool_const_class *>(e) ||
+      dynamic_cast<string_const_class *>(e))
+  {
+    return true;
+  }
+  if (auto o = dynamic_cast<object_class *>(e))
+  {
+    if (loop.assigned.count(o->name) || loop.bound.count(o->name))
+    {
+      return false;
+    }
+    return o->name == self || is_local(o->name) || !loop.calls ||
+           !assigned_anywhere.count(o->name);
+  }
+  if (auto d = dynamic_cast<dispatch_class *>(e))
+  {
+    return d->name == length && d->actual->len() == 0 && d->expr->get_type() == Str &&
+           is_invariant(d->expr);
+  }
+  if (dynamic_cast<plus_class *>(e) || dynamic_cast<sub_class *>(e) ||
+      dynamic_cast<mul_class *>(e) || dynamic_cast<lt_class *>(e) ||
+      dynamic_cast<leq_class *>(e) || dynamic_cast<eq_class *>(e) ||
+      dynamic_cast<neg_class *>(e) || dynamic_cast<comp_class *>(e))
+  {
+    std::vector<Expression> subs;
+    get_subexpressions(e, subs);
+    for (Expression sub : subs)
+    {
+      if (!is_invariant(sub))
+      {
+        return false;
+      }
+    }
+    return true;
+  }
+  return false;
+}
+
+bool Hoister::worth_moving(Expression e)
+{
+  if (auto o = dynamic_cast<object_class *>(e))
+  {
+    return o->name != self && !is_local(o->name) && !loops.back().calls &&
+           (o->get_type() == Int || o->get_type() == Bool);
+  }
+  return !dynamic_cast<int_const_class *>(e) && !dynamic_cast<bool_const_class *>(e) &&
+         !dynamic_cast<string_const_class *>(e);
+}
+
+//
+// The name standing for `e' outside the loop, which is the same for
+// every copy of it.
+//
+Expression Hoister::move(Expression e)
+{
+  Loop &loop = loops.back();
+  Symbol name = NULL;
+  for (auto &m : loop.moved)
+  {
+    if (same_value(m.second, e))
+    {
+      name = m.first;
+    }
+  }
+  if (!name)
+  {
+    name = fresh_name(idtable.add_string("loop"));
+    loop.moved.push_back({name, e});
+    moved++;
+  }
+  return (Expression)object(name)->set_type(e->get_type())->set(e);
+}
+
+Expression Hoister::hoist_in_scope(Symbol name, Expression e)
+{
+  scope.push_back(name);
+  e = hoist(e);
+  scope.pop_back();
+  return e;
+}
+
+Expressions Hoister::hoist_list(Expressions l)
+{
+  Expressions result = nil_Expressions();
+  for (int i = l->first(); l->more(i); i = l->next(i))
+  {
+    result = append_Expressions(result, single_Expressions(hoist(l->nth(i))));
+  }
+  return result;
+}
+
+Expression Hoister::hoist_loop(loop_class *l)
+{
+  loops_seen++;
+  loops.push_back({});
+  find_names(l, loops.back().assigned, loops.back().bound);
+  loops.back().calls = may_call(l);
+  loops.back().rebound = 0;
+  l->pred = hoist(l->pred);
+  l->body = hoist(l->body);
+  std::vector<std::pair<Symbol, Expression>> moved = loops.back().moved;
+  loops.pop_back();
+
+  // The values are computed in the order they were found, and each may
+  // itself be invariant in a loop around this one.
+  Expression result = l;
+  for (auto it = moved.rbegin(); it != moved.rend(); it++)
+  {
+    result = (Expression)let(it->first, it->second->get_type(), it->second, result)
+                 ->set_type(l->get_type())
+                 ->set(l);
+  }
+  for (auto &m : moved)
+  {
+    for (auto &outer : loops)
+    {
+      outer.bound.insert(m.first);
+    }
+  }
+  Expression let_exp = result;
+  for (size_t i = 0; i < moved.size(); i++)
+  {
+    let_class *binding = (let_class *)let_exp;
+    binding->init = hoist(binding->init);
+    let_exp = binding->body;
+  }
+  return result;
+}
+
+Expression Hoister::hoist(Expression e)
+{
+  if (!loops.empty() && loops.back().rebound == 0 && is_invariant(e) && worth_moving(e))
+  {
+    return move(e);
+  }
+  if (auto l = dynamic_cast<loop_class *>(e))
+  {
+    return hoist_loop(l);
+  }
+  else if (auto d = dynamic_cast<static_dispatch_class *>(e))
+  {
+    d->expr = hoist(d->expr);
+    d->actual = hoist_list(d->actual);
+  }
+  else if (auto d = dynamic_cast<dispatch_class *>(e))
+  {
+    d->expr = hoist(d->expr);
+    d->actual = hoist_list(d->actual);
+  }
+  else if (auto l = dynamic_cast<let_class *>(e))
+  {
+    l->init = hoist(l->init);
+    if (l->identifier == self)
+    {
+      for (auto &loop : loops)
+      {
+        loop.rebound++;
+      }
+      l->body = hoist(l->body);
+      for (auto &loop : loops)
+      {
+        loop.rebound--;
+      }
+    }
+    else
+    {
+      l->body = hoist_in_scope(l->identifier, l->body);
+    }
+  }
+  else if (auto t = dynamic_cast<typcase_class *>(e))
+  {
+    t->expr = hoist(t->expr);
+    for (int i = t->cases->first(); t->cases->more(i); i = t->cases->next(i))
+    {
+      branch_class *b = (branch_class *)t->cases->nth(i);
+      b->expr = hoist_in_scope(b->name, b->expr);
+    }
+  }
+  else if (auto a = dynamic_cast<assign_class *>(e))
+  {
+    a->expr = hoist(a->expr);
+  }
+  else if (auto c = dynamic_cast<cond_class *>(e))
+  {
+    c->pred = hoist(c->pred);
+    c->then_exp = hoist(c->then_exp);
+    c->else_exp = hoist(c->else_exp);
+  }
+  else if (auto b = dynamic_cast<block_class *>(e))
+  {
+    b->body = hoist_list(b->body);
+  }
+  else if (auto x = dynamic_cast<plus_class *>(e))
+  {
+    x->e1 = hoist(x->e1);
+    x->e2 = hoist(x->e2);
+  }
+  else if (auto x = dynamic_cast<sub_class *>(e))
+  {
+    x->e1 = hoist(x->e1);
+    x->e2 = hoist(x->e2);
+  }
+  else if (auto x = dynamic_cast<mul_class *>(e))
+  {
+    x->e1 = hoist(x->e1);
+    x->e2 = hoist(x->e2);
+  }
+  else if (auto x = dynamic_cast<divide_class *>(e))
+  {
+    x->e1 = hoist(x->e1);
+    x->e2 = hoist(x->e2);
+  }
+  else if (auto x = dynamic_cast<lt_class *>(e))
+  {
+    x->e1 = hoist(x->e1);
+    x->e2 = hoist(x->e2);
+  }
+  else if (auto x = dynamic_cast<eq_class *>(e))
+  {
+    x->e1 = hoist(x->e1);
+    x->e2 = hoist(x->e2);
+  }
+  else if (auto x = dynamic_cast<leq_class *>(e))
+  {
+    x->e1 = hoist(x->e1);
+    x->e2 = hoist(x->e2);
+  }
+  else if (auto x = dynamic_cast<neg_class *>(e))
+  {
+    x->e1 = hoist(x->e1);
+  }
+  else if (auto x = dynamic_cast<comp_class *>(e))
+  {
+    x->e1 = hoist(x->e1);
+  }
+  else if (auto x = dynamic_cast<isvoid_class *>(e))
+  {
+    x->e1 = hoist(x->e1);
+  }
+  return e;
+}
+
+void Hoister::hoist_routine(Formals formals, Expression &e)
+{
+  for (int i = formals->first(); formals->more(i); i = formals->next(i))
+  {
+    scope.push_back(formals->nth(i)->get_name());
+  }
+  e = hoist(e);
+  scope.clear();
+}
+
+} // namespace
+
+void hoist_invariants()
+{
+  Hoister hoister;
+  for (auto cls : cls_ordered)
+  {
+    if (is_basic_class(cls->get_name()))
+    {
+      continue;
+    }
+    Features features = cls->get_features();
+    for (int j = features->first(); features->more(j); j = features->next(j))
+    {
+      if (auto m = dynamic_cast<method_class *>(features->nth(j)))
+      {
+        hoister.hoist_routine(m->formals, m->expr);
+      }
+      else if (auto a = dynamic_cast<attr_class *>(features->nth(j)))
+      {
+        hoister.hoist_routine(nil_Formals(), a->init);
+      }
+    }
+  }
+
+  if (cgen_debug)
+    cerr << "moved " << hoister.moved << " loop-invariant expressions out of "
+         << hoister.loops_seen << " loops" << endl;
+}
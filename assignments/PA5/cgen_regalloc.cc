@@ -0,0 +1,226 @@
+//**************************************************************
+//
+// Register allocation for the values local to a method or to the
+// attribute initializers of a class.
+//
+// The candidates are the formals, let and case bindings, and the
+// left operand of an arithmetic or comparison operator, which is
+// otherwise pushed while the right operand is evaluated.  Each one
+// is live over an interval of a numbering of the method body in
+// evaluation order, and the intervals are given registers by linear
+// scan.  A register costs a save and a restore per call, so one is
+// only kept if the values given to it save more than that, counting
+// code in loops as running ten times per enclosing loop.  Values left
+// without a register stay on the stack, where the code generator
+// keeps them when allocation is disabled with -r.  Unboxed Ints and
+// Bools live in the $t5-$t7 temporaries instead where no Cool code
+// runs during their lifetime, and are not candidates here.
+//
+// Only $s1-$s6 are handed out.  They are callee-saved, so values in
+// them survive dispatches and runtime calls without spilling: a routine
+// saves the ones it uses in its frame.  They are also in the register
+// mask of the garbage collector, which updates the pointers they hold.
+// $s7 is the heap limit of the runtime, and the $t registers are
+// scratch for the code generator and clobbered by every runtime call.
+//
+//**************************************************************
+
+#include "cgen.h"
+
+extern bool disable_reg_alloc;
+
+static char *alloc_regs[] = {"$s1", "$s2", "$s3", "$s4", "$s5", "$s6"};
+
+namespace
+{
+
+struct Interval
+{
+  tree_node *value;
+  int start;
+  int end;
+  int benefit; // instructions or memory accesses saved per call
+};
+
+class LinearScan
+{
+private:
+  std::vector<Interval> intervals;
+  std::map<Symbol, int> formal_uses;
+  int counter = 0;
+  int frequency = 1;
+
+  // A push and a pop become a move in and out of the register.
+  void add(tree_node *value, int start)
+  {
+    intervals.push_back({value, start, counter, 2 * frequency});
+  }
+  void number(Expression e);
+
+public:
+  void allocate(Formals formals, const std::vector<Expression> &bodies, Environment &env);
+};
+
+void LinearScan::number(Expression e)
+{
+  counter++;
+  if (auto l = dynamic_cast<let_class *>(e))
+  {
+    number(l->init);
+    int start = counter;
+    number(l->body);
+    if (!unbox_binding(l) || may_call(l->body))
+    {
+      add(l, start);
+    }
+  }
+  else if (auto t = dynamic_cast<typcase_class *>(e))
+  {
+    number(t->expr);
+    int start = counter;
+    for (int i = t->cases->first(); t->cases->more(i); i = t->cases->next(i))
+    {
+      number(t->cases->nth(i)->get_expr());
+    }
+    add(t, start);
+  }
+  else if (dynamic_cast<plus_class *>(e) || dynamic_cast<sub_class *>(e) ||
+           dynamic_cast<mul_class *>(e) || dynamic_cast<divide_class *>(e) ||
+           dynamic_cast<lt_class *>(e) || dynamic_cast<eq_class *>(e) ||
+           dynamic_cast<leq_class *>(e))
+  {
+    std::vector<Expression> subs;
+    get_subexpressions(e, subs);
+    number(subs[0]);
+    int start = counter;
+    number(subs[1]);
+    if (!has_unboxed_operands(e) || may_call(subs[1]))
+    {
+      add(e, start);
+    }
+  }
+  else if (auto l = dynamic_cast<loop_class *>(e))
+  {
+    int outer = frequency;
+    frequency = std::min(frequency * 10, 1000000);
+    number(l->pred);
+    number(l->body);
+    frequency = outer;
+  }
+  else
+  {
+    if (auto o = dynamic_cast<object_class *>(e))
+    {
+      auto it = formal_uses.find(o->name);
+      if (it != formal_uses.end())
+      {
+        it->second += frequency;
+      }
+    }
+    std::vector<Expression> subs;
+    get_subexpressions(e, subs);
+    for (Expression sub : subs)
+    {
+      number(sub);
+    }
+  }
+  counter++;
+}
+
+void LinearScan::allocate(Formals formals, const std::vector<Expression> &bodies, Environment &env)
+{
+  for (int i = formals->first(); formals->more(i); i = formals->next(i))
+  {
+    formal_uses[formals->nth(i)->get_name()] = 0;
+  }
+  for (Expression body : bodies)
+  {
+    number(body);
+  }
+
+  // A formal is loaded into its register once on entry instead of from
+  // the frame at every use.
+  for (int i = formals->first(); formals->more(i); i = formals->next(i))
+  {
+    int uses = formal_uses[formals->nth(i)->get_name()];
+    if (uses > 1)
+    {
+      intervals.push_back({formals->nth(i), 0, counter, uses - 1});
+    }
+  }
+
+  std::stable_sort(intervals.begin(), intervals.end(),
+                   [](const Interval &a, const Interval &b) {
+                     return a.start < b.start || (a.start == b.start && a.end > b.end);
+                   });
+
+  std::vector<Interval> active;
+  std::map<tree_node *, char *> assigned;
+  std::vector<char *> free_regs(std::rbegin(alloc_regs), std::rend(alloc_regs));
+  for (const Interval &cur : intervals)
+  {
+    for (auto it = active.begin(); it != active.end();)
+    {
+      if (it->end <= cur.start)
+      {
+        free_regs.push_back(assigned[it->value]);
+        it = active.erase(it);
+      }
+      else
+      {
+        it++;
+      }
+    }
+
+    if (!free_regs.empty())
+    {
+      assigned[cur.value] = free_regs.back();
+      free_regs.pop_back();
+      active.push_back(cur);
+      continue;
+    }
+
+    // Spill whichever of the live values ends last.
+    auto last = std::max_element(active.begin(), active.end(),
+                                 [](const Interval &a, const Interval &b) { return a.end < b.end; });
+    if (last->end > cur.end)
+    {
+      assigned[cur.value] = assigned[last->value];
+      assigned.erase(last->value);
+      *last = cur;
+    }
+  }
+
+  std::map<char *, int> benefit;
+  for (const Interval &i : intervals)
+  {
+    auto it = assigned.find(i.value);
+    if (it != assigned.end())
+    {
+      benefit[it->second] += i.benefit;
+    }
+  }
+
+  // Recorded in interval order, which is also the order the registers
+  // are saved in.
+  for (const Interval &i : intervals)
+  {
+    auto it = assigned.find(i.value);
+    if (it != assigned.end() && benefit[it->second] > 2)
+    {
+      env.set_reg(i.value, it->second);
+    }
+  }
+}
+
+} // namespace
+
+void allocate_registers(Formals formals, const std::vector<Expression> &bodies, Environment &env)
+{
+  env.clear_regs();
+  if (disable_reg_alloc)
+  {
+    return;
+  }
+  LinearScan().allocate(formals, bodies, env);
+}
@@ -10,6 +10,10 @@
 
 #include "tree.h"
 #include "cool-tree.handcode.h"
+#include <algorithm>
+#include <map>
+#include <set>
+#include <string>
 #include <vector>
 
 class method_class;
@@ -959,7 +963,65 @@ class Environment
    Class_ cls;
    std::vector<attr_class *> cls_attrs;
    std::vector<Formal> mth_args;
+   // The temporaries of the routine being emitted, in fixed slots of
+   // its frame below the registers it saves, handed out in stack order.
+   // The frame is sized for the most slots in use at once.
    std::vector<Symbol> stack_symbols;
+   std::vector<bool> stack_raw; // holds a machine integer
+   int frame_saved = 0;
+   int frame_slots = 0;
+   std::string label_prefix;
+   int label_count = 0;
+
+   // Register allocation of the routine being emitted: the register
+   // given to each value that has one, the registers to save, and the
+   // let and case bindings in scope (NULL if kept on the stack).
+   struct Local
+   {
+      Symbol name;
+      char *reg;
+      bool unboxed;  // holds a machine integer rather than an object
+      bool non_void; // is never void
+   };
+   std::map<tree_node *, char *> regs;
+   std::vector<char *> saved_regs;
+   std::vector<Local> locals;
+   int scratch_used = 0;
+
+   // The method being emitted, the label its body starts at, which a
+   // call of the method itself in tail position jumps back to, and the
+   // calls in tail position.
+   method_class *method = NULL;
+   std::string body_label;
+   std::set<tree_node *> tail_calls;
+
+   // Whether the method being emitted is a leaf, which has no frame and
+   // addresses its arguments and slots from SP.
+   bool leaf = false;
+
+   // Assignments to attributes of an object that no collection can have
+   // promoted since it was made, which need not tell the collector.
+   std::set<tree_node *> young_stores;
+
+   // The stack maps of the routines emitted: the word offsets from FP of
+   // the slots of a frame that hold machine integers at some point, and
+   // the label of each.
+   std::map<std::vector<int>, std::string> stack_maps;
+
+public:
+   // A call of one of the runtime's abort routines that the routine
+   // being emitted branches to when a check fails.  The calls are made
+   // after the routine's code, one for each routine, file and line.
+   struct AbortStub
+   {
+      std::string label;
+      std::string routine;
+      Symbol filename; // NULL if the routine takes no location
+      int line;
+   };
+
+private:
+   std::vector<AbortStub> abort_stubs;
 
 public:
    Class_ get_cls()
@@ -986,6 +1048,17 @@ public:
       cls_attrs.push_back(attr);
    }
 
+   // The attributes in scope, replaced while the body of a method of
+   // another class is inlined.
+   const std::vector<attr_class *> &get_cls_attrs()
+   {
+      return cls_attrs;
+   }
+   void set_cls_attrs(const std::vector<attr_class *> &attrs)
+   {
+      cls_attrs = attrs;
+   }
+
    void add_mth_arg(Formal formal)
    {
       mth_args.push_back(formal);
@@ -996,13 +1069,227 @@ public:
       mth_args.clear();
    }
 
-   void push_stack_symbol(Symbol name)
+   // Labels are local to the routine being emitted: <prefix>.L<n>
+   void set_label_prefix(const std::string &prefix)
+   {
+      label_prefix = prefix;
+      label_count = 0;
+   }
+   std::string new_label()
+   {
+      return label_prefix + ".L" + std::to_string(label_count++);
+   }
+
+   void clear_regs()
+   {
+      regs.clear();
+      saved_regs.clear();
+   }
+   void set_reg(tree_node *value, char *reg)
+   {
+      regs[value] = reg;
+      if (std::find(saved_regs.begin(), saved_regs.end(), reg) == saved_regs.end())
+      {
+         saved_regs.push_back(reg);
+      }
+   }
+   // The register holding `value', or NULL if it lives on the stack.
+   char *get_reg(tree_node *value)
+   {
+      auto it = regs.find(value);
+      return it == regs.end() ? NULL : it->second;
+   }
+   const std::vector<char *> &get_saved_regs()
+   {
+      return saved_regs;
+   }
+
+   void push_local(Symbol name, char *reg, bool unboxed = false, bool non_void = false)
+   {
+      locals.push_back({name, reg, unboxed, non_void});
+   }
+   void pop_local()
+   {
+      locals.pop_back();
+   }
+   // Whether `name' is a let or case binding; if so `reg' is set to its
+   // register, or NULL when it is on the stack, and `unboxed' to whether
+   // it holds a machine integer.
+   bool lookup_local(Symbol name, char **reg, bool *unboxed = NULL)
+   {
+      for (int i = locals.size() - 1; i >= 0; i--)
+      {
+         if (locals[i].name == name)
+         {
+            *reg = locals[i].reg;
+            if (unboxed)
+            {
+               *unboxed = locals[i].unboxed;
+            }
+            return true;
+         }
+      }
+      return false;
+   }
+
+   // Whether `name' is a let or case binding that is never void.
+   bool is_non_void_local(Symbol name)
+   {
+      for (int i = locals.size() - 1; i >= 0; i--)
+      {
+         if (locals[i].name == name)
+         {
+            return locals[i].non_void;
+         }
+      }
+      return false;
+   }
+
+   std::string get_abort_stub(const std::string &routine, Symbol filename, int line)
+   {
+      for (auto &stub : abort_stubs)
+      {
+         if (stub.routine == routine && stub.filename == filename && stub.line == line)
+         {
+            return stub.label;
+         }
+      }
+      abort_stubs.push_back({new_label(), routine, filename, line});
+      return abort_stubs.back().label;
+   }
+   const std::vector<AbortStub> &get_abort_stubs()
+   {
+      return abort_stubs;
+   }
+   void clear_abort_stubs()
+   {
+      abort_stubs.clear();
+   }
+
+   void set_method(method_class *method, const std::string &body_label,
+                   const std::set<tree_node *> &tail_calls)
+   {
+      this->method = method;
+      this->body_label = body_label;
+      this->tail_calls = tail_calls;
+   }
+   method_class *get_method()
+   {
+      return method;
+   }
+   const std::string &get_body_label()
+   {
+      return body_label;
+   }
+   bool is_tail_call(tree_node *call)
+   {
+      return tail_calls.count(call) > 0;
+   }
+   void set_leaf(bool leaf)
+   {
+      this->leaf = leaf;
+   }
+   bool is_leaf()
+   {
+      return leaf;
+   }
+   void add_young_store(tree_node *assign)
+   {
+      young_stores.insert(assign);
+   }
+   bool is_young_store(tree_node *assign)
+   {
+      return young_stores.count(assign) > 0;
+   }
+   // The word offset of argument `pos' from FP, or from SP in a leaf.
+   int get_arg_offset(int pos)
+   {
+      if (leaf)
+      {
+         return mth_args.size() - pos;
+      }
+      return 2 + mth_args.size() - pos;
+   }
+
+   // The unboxed temporaries are handed out in stack order.
+   int get_scratch_used()
+   {
+      return scratch_used;
+   }
+   void set_scratch_used(int n)
+   {
+      scratch_used = n;
+   }
+   char *get_arg_reg(Symbol name)
+   {
+      int pos = get_arg_pos(name);
+      return pos == -1 ? NULL : get_reg(mth_args[pos]);
+   }
+
+   // Start the frame of a routine that saves `nsaved' registers.
+   void start_frame(int nsaved)
+   {
+      stack_symbols.clear();
+      stack_raw.clear();
+      frame_saved = nsaved;
+      frame_slots = 0;
+   }
+   int get_frame_slots()
+   {
+      return frame_slots;
+   }
+
+   // Take the next slot for `name' and return its word offset from FP,
+   // or from SP in a leaf, which keeps its slots below SP.
+   int push_stack_symbol(Symbol name, bool raw = false)
    {
       stack_symbols.push_back(name);
+      stack_raw.push_back(raw);
+      frame_slots = std::max(frame_slots, int(stack_symbols.size()));
+      return get_top_slot_offset();
    }
    void pop_stack_symbol()
    {
       stack_symbols.pop_back();
+      stack_raw.pop_back();
+   }
+   // The word offsets of the slots that hold machine integers.
+   std::vector<int> get_raw_slot_offsets()
+   {
+      std::vector<int> offsets;
+      for (int i = 0; i < int(stack_raw.size()); i++)
+      {
+         if (stack_raw[i])
+         {
+            offsets.push_back(-frame_saved - i - 1);
+         }
+      }
+      return offsets;
+   }
+
+   // The label of the stack map of the raw slots at `offsets', made the
+   // first time it is asked for.
+   std::string get_stack_map(const std::vector<int> &offsets)
+   {
+      auto it = stack_maps.find(offsets);
+      if (it != stack_maps.end())
+      {
+         return it->second;
+      }
+      return stack_maps[offsets] = new_label();
+   }
+   const std::map<std::vector<int>, std::string> &get_stack_maps()
+   {
+      return stack_maps;
+   }
+   // Give the innermost slot to `name'.
+   void name_stack_symbol(Symbol name)
+   {
+      stack_symbols.back() = name;
+   }
+   int get_top_slot_offset()
+   {
+      return -frame_saved - int(stack_symbols.size());
    }
 
    int get_cls_attr_pos(Symbol name)
@@ -1017,16 +1304,17 @@ public:
       return -1;
    }
 
-   int get_let_var_pos_rev(Symbol name)
+   // The offset of the slot of the innermost binding of `name'.
+   int get_slot_offset(Symbol name)
    {
       for (int i = stack_symbols.size() - 1; i >= 0; i--)
       {
          if (stack_symbols[i] == name)
          {
-            return stack_symbols.size() - i - 1;
+            return -frame_saved - i - 1;
          }
       }
-      return -1;
+      return 0;
    }
 
    int get_arg_pos(Symbol name)
@@ -93,6 +93,7 @@ typedef Cases_class *Cases;
 		return this;                                  \
 	}                                                 \
 	virtual void code(ostream &, Environment &) = 0;  \
+	virtual void code_value(ostream &, Environment &); \
 	virtual void dump_with_types(ostream &, int) = 0; \
 	void dump_type(ostream &, int);                   \
 	Expression_class() { type = (Symbol)NULL; }
@@ -101,4 +102,27 @@ typedef Cases_class *Cases;
 	void code(ostream &, Environment &); \
 	void dump_with_types(ostream &, int);
 
+// Expressions of type Int or Bool whose machine value, left in ACC by
+// code_value, can be computed without creating an object.
+#define Value_EXTRAS \
+	void code_value(ostream &, Environment &);
+
+#define assign_EXTRAS Value_EXTRAS
+#define cond_EXTRAS Value_EXTRAS
+#define block_EXTRAS Value_EXTRAS
+#define let_EXTRAS Value_EXTRAS
+#define plus_EXTRAS Value_EXTRAS
+#define sub_EXTRAS Value_EXTRAS
+#define mul_EXTRAS Value_EXTRAS
+#define divide_EXTRAS Value_EXTRAS
+#define neg_EXTRAS Value_EXTRAS
+#define lt_EXTRAS Value_EXTRAS
+#define eq_EXTRAS Value_EXTRAS
+#define leq_EXTRAS Value_EXTRAS
+#define comp_EXTRAS Value_EXTRAS
+#define int_const_EXTRAS Value_EXTRAS
+#define bool_const_EXTRAS Value_EXTRAS
+#define isvoid_EXTRAS Value_EXTRAS
+#define object_EXTRAS Value_EXTRAS
+
 #endif
@@ -34,6 +34,7 @@
 #define PROTOBJ_SUFFIX "_protObj"
 #define OBJECTPROTOBJ "Object" PROTOBJ_SUFFIX
 #define INTCONST_PREFIX "int_const"
+#define INTCACHE "int_cache"
 #define STRCONST_PREFIX "str_const"
 #define BOOLCONST_PREFIX "bool_const"
 
@@ -68,11 +69,22 @@
 //
 #define ZERO "$zero" // Zero register
 #define ACC "$a0"    // Accumulator
+#define V1 "$v1"     // Caller's self in a leaf method
 #define A1 "$a1"     // For arguments to prim funcs
 #define SELF "$s0"   // Ptr to self (callee saves)
 #define T1 "$t1"     // Temporary 1
 #define T2 "$t2"     // Temporary 2
 #define T3 "$t3"     // Temporary 3
+#define T4 "$t4"     // Stack map of the frame
+// The runtime never touches $t5-$t8 and the collector neither scans nor
+// updates them, so they hold unboxed integers across runtime calls.
+#define T5 "$t5" // Unboxed temporary 1
+#define T6 "$t6" // Unboxed temporary 2
+#define T7 "$t7" // Unboxed temporary 3
+#define T8 "$t8" // Value being boxed
+// The runtime allocates from $gp up to $s7 under every collector.
+#define HEAP_PTR "$gp"   // Next free byte of the heap
+#define HEAP_LIMIT "$s7" // End of the heap
 #define SP "$sp"     // Stack pointer
 #define FP "$fp"     // Frame pointer
 #define RA "$ra"     // Return address
@@ -82,6 +94,7 @@
 //
 #define JALR "\tjalr\t"
 #define JAL "\tjal\t"
+#define JUMP "\tj\t"
 #define RET "\tjr\t" RA "\t"
 
 #define SW "\tsw\t"
@@ -99,6 +112,8 @@
 #define MUL "\tmul\t"
 #define SUB "\tsub\t"
 #define SLL "\tsll\t"
+#define SRA "\tsra\t"
+#define SRL "\tsrl\t"
 #define BEQZ "\tbeqz\t"
 #define BRANCH "\tb\t"
 #define BEQ "\tbeq\t"
@@ -0,0 +1,56 @@
+-- Object.copy returns an object of the class of its receiver, not of
+-- the static type.  Under -O -u a copy whose classes were inferred from
+-- the static type would dispatch to the wrong method and take the wrong
+-- case branch below.
+
+
+class Shape
+{
+  name() : String { "shape" };
+
+  clone() : Shape { copy() };
+};
+
+
+class Square inherits Shape
+{
+  name() : String { "square" };
+};
+
+
+class Circle inherits Shape
+{
+  name() : String { "circle" };
+};
+
+
+class Main inherits IO
+{
+  main() : Object
+  {
+    let shape : Shape <- new Square,
+        copied : Object <- (new Circle).copy()
+    in {
+      out_string(shape.clone().name());
+      out_string("\n");
+      case shape.copy() of
+        c : Circle => out_string("circle\n");
+        s : Square => out_string("square\n");
+        s : Shape => out_string("shape\n");
+      esac;
+      case copied of
+        s : Shape => out_string(s.name().concat("\n"));
+        o : Object => out_string("object\n");
+      esac;
+      case copy() of
+        m : Main => out_string("main\n");
+        o : Object => out_string("object\n");
+      esac;
+      -- An Int copied through Object keeps its class and value.
+      case (5).copy() of
+        i : Int => { out_int(i + 1); out_string("\n"); };
+        o : Object => out_string("object\n");
+      esac;
+    }
+  };
+};
@@ -0,0 +1,65 @@
+-- new SELF_TYPE in an inherited method creates an object of the class
+-- of self, which may be any subclass of the class defining the method.
+-- Under -O -u an object whose classes were inferred from the defining
+-- class would dispatch to the wrong method and take the wrong case
+-- branch below.
+
+
+class Animal
+{
+  sound() : String { "..." };
+
+  offspring() : Animal { new SELF_TYPE };
+
+  twin() : SELF_TYPE { new SELF_TYPE };
+};
+
+
+class Dog inherits Animal
+{
+  sound() : String { "woof" };
+};
+
+
+class Puppy inherits Dog
+{
+  sound() : String { "yip" };
+};
+
+
+class Cat inherits Animal
+{
+  sound() : String { "meow" };
+};
+
+
+class Main inherits IO
+{
+  main() : Object
+  {
+    let dog : Animal <- new Dog,
+        cat : Cat <- new Cat
+    in {
+      out_string(dog.offspring().sound());
+      out_string("\n");
+      out_string(cat.twin().sound());
+      out_string("\n");
+      out_string((new Puppy).offspring().offspring().sound());
+      out_string("\n");
+      case dog.offspring() of
+        p : Puppy => out_string("puppy\n");
+        d : Dog => out_string("dog\n");
+        a : Animal => out_string("animal\n");
+      esac;
+      case cat.offspring() of
+        d : Dog => out_string("dog\n");
+        c : Cat => out_string("cat\n");
+        a : Animal => out_string("animal\n");
+      esac;
+      case (new Puppy).twin() of
+        d : Dog => out_string(d.sound().concat("\n"));
+        a : Animal => out_string("animal\n");
+      esac;
+    }
+  };
+};
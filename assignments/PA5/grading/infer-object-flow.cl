@@ -0,0 +1,78 @@
+-- Values stored in Object-typed attributes and passed as Object-typed
+-- formals keep their classes.  Under -O -u a value whose classes were
+-- lost on the way would take the wrong case branch below.
+
+
+class Box
+{
+  item : Object;
+
+  put(x : Object) : SELF_TYPE { { item <- x; self; } };
+
+  get() : Object { item };
+};
+
+
+class Thing
+{
+  label() : String { "thing" };
+};
+
+
+class Widget inherits Thing
+{
+  label() : String { "widget" };
+};
+
+
+class Main inherits IO
+{
+  held : Object <- new Widget;
+
+  kind(x : Object) : String
+  {
+    case x of
+      i : Int => "int ".concat(show(i));
+      s : String => "string ".concat(s);
+      b : Bool => if b then "bool true" else "bool false" fi;
+      w : Widget => "widget";
+      t : Thing => "thing";
+      m : Main => "main";
+      o : Object => "object";
+    esac
+  };
+
+  show(i : Int) : String
+  {
+    if i = 0 then "0" else
+    if i < 10 then "123456789".substr(i - 1, 1) else
+      show(i / 10).concat(show(i - i / 10 * 10))
+    fi fi
+  };
+
+  say(s : String) : Object { out_string(s.concat("\n")) };
+
+  main() : Object
+  {
+    let box : Box <- new Box
+    in {
+      say(kind(box.put(42).get()));
+      say(kind(box.put("hello").get()));
+      say(kind(box.put(true).get()));
+      say(kind(box.put(new Thing).get()));
+      say(kind(box.put(held).get()));
+      say(kind(box.put(self).get()));
+      say(kind(box.put(new Object).get()));
+      say(kind(box));
+      held <- 7;
+      case held of
+        t : Thing => say(t.label());
+        i : Int => say(show(i * 6));
+      esac;
+      case box.get() of
+        t : Thing => say(t.label());
+        o : Object => say("other");
+      esac;
+    }
+  };
+};
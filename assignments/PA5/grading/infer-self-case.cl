@@ -0,0 +1,68 @@
+-- A method declared to return SELF_TYPE returns an object of the class
+-- of its receiver.  Under -O -u a result whose classes were inferred
+-- from the defining class would take the wrong case branch below.
+
+
+class Node
+{
+  me() : SELF_TYPE { self };
+
+  again() : SELF_TYPE { me() };
+
+  fresh() : SELF_TYPE { new SELF_TYPE };
+};
+
+
+class Leaf inherits Node
+{
+};
+
+
+class Branch inherits Node
+{
+  me() : SELF_TYPE { self };
+};
+
+
+class Main inherits IO
+{
+  which(n : Node) : Object
+  {
+    case n of
+      l : Leaf => out_string("leaf\n");
+      b : Branch => out_string("branch\n");
+      n : Node => out_string("node\n");
+    esac
+  };
+
+  main() : Object
+  {
+    let leaf : Node <- new Leaf,
+        branch : Node <- new Branch
+    in {
+      case leaf.me() of
+        l : Leaf => out_string("leaf\n");
+        n : Node => out_string("node\n");
+      esac;
+      case branch.again() of
+        b : Branch => out_string("branch\n");
+        n : Node => out_string("node\n");
+      esac;
+      case leaf.fresh().again() of
+        b : Branch => out_string("branch\n");
+        l : Leaf => out_string("leaf\n");
+        n : Node => out_string("node\n");
+      esac;
+      case (new Node).me() of
+        l : Leaf => out_string("leaf\n");
+        n : Node => out_string("node\n");
+      esac;
+      case out_string("main: ") of
+        m : Main => out_string("main\n");
+        o : Object => out_string("object\n");
+      esac;
+      which(leaf.again());
+      which(branch.fresh());
+    }
+  };
+};
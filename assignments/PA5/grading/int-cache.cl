@@ -0,0 +1,60 @@
+-- Ints just inside and just outside the table of preboxed Ints.  The
+-- cases compile this under -O with the table holding only 0 (-b 0:0),
+-- with it empty (-b 5:1), and with it as wide as -b allows; without -b
+-- the default bounds -128 and 1023 are covered too.
+
+
+class Cell
+{
+  value : Object;
+  next : Cell;
+
+  init(v : Object, n : Cell) : Cell { { value <- v; next <- n; self; } };
+
+  value() : Object { value };
+
+  next() : Cell { next };
+};
+
+
+class Main inherits IO
+{
+  cells : Cell;
+
+  -- Keep every Int from `low' to `high' as an object.
+  keep(low : Int, high : Int) : Object
+  {
+    while low <= high loop
+    {
+      cells <- (new Cell).init(low, cells);
+      low <- low + 1;
+    }
+    pool
+  };
+
+  main() : Object
+  {
+    {
+      keep(32766, 32768);
+      keep(1022, 1024);
+      keep(6, 6);
+      keep(~2, 2);
+      keep(~129, ~127);
+      keep(~32768, ~32766);
+      let c : Cell <- cells, sum : Int in
+      {
+        while not isvoid c loop
+        {
+          case c.value() of
+            i : Int => { out_int(i); out_string(" "); sum <- sum + i; };
+          esac;
+          c <- c.next();
+        }
+        pool;
+        out_string("\n");
+        out_int(sum);
+        out_string("\n");
+      };
+    }
+  };
+};
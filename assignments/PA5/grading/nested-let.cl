@@ -0,0 +1,65 @@
+(*
+ * A let with many Int bindings, each a let nested in the one before.
+ * Whether a binding is unboxed depends on the bindings nested in its
+ * body, and compiling this must not take time exponential in how deep
+ * they go.
+ *)
+class Main inherits IO {
+  main() : Object {
+    let x0 : Int <- 0,
+      x1 : Int <- 1,
+      x2 : Int <- 2,
+      x3 : Int <- 3,
+      x4 : Int <- 4,
+      x5 : Int <- 5,
+      x6 : Int <- 6,
+      x7 : Int <- 7,
+      x8 : Int <- 8,
+      x9 : Int <- 9,
+      x10 : Int <- 10,
+      x11 : Int <- 11,
+      x12 : Int <- 12,
+      x13 : Int <- 13,
+      x14 : Int <- 14,
+      x15 : Int <- 15,
+      x16 : Int <- 16,
+      x17 : Int <- 17,
+      x18 : Int <- 18,
+      x19 : Int <- 19,
+      x20 : Int <- 20,
+      x21 : Int <- 21,
+      x22 : Int <- 22,
+      x23 : Int <- 23
+    in {
+      let i : Int <- 0 in
+        while i < 3 loop {
+          x1 <- x1 + x0;
+          x2 <- x2 + x1;
+          x3 <- x3 + x2;
+          x4 <- x4 + x3;
+          x5 <- x5 + x4;
+          x6 <- x6 + x5;
+          x7 <- x7 + x6;
+          x8 <- x8 + x7;
+          x9 <- x9 + x8;
+          x10 <- x10 + x9;
+          x11 <- x11 + x10;
+          x12 <- x12 + x11;
+          x13 <- x13 + x12;
+          x14 <- x14 + x13;
+          x15 <- x15 + x14;
+          x16 <- x16 + x15;
+          x17 <- x17 + x16;
+          x18 <- x18 + x17;
+          x19 <- x19 + x18;
+          x20 <- x20 + x19;
+          x21 <- x21 + x20;
+          x22 <- x22 + x21;
+          x23 <- x23 + x22;
+          i <- i + 1;
+        } pool;
+      out_int(x0 + x1 + x2 + x3 + x4 + x5 + x6 + x7 + x8 + x9 + x10 + x11 + x12 + x13 + x14 + x15 + x16 + x17 + x18 + x19 + x20 + x21 + x22 + x23);
+      out_string("\n");
+    }
+  };
+};
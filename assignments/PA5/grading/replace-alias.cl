@@ -0,0 +1,61 @@
+-- Under -O an object made by new that never leaves the code around it
+-- is replaced by its attributes.  Other names bound to it are aliases
+-- of it, and isvoid and = on it are decided at compile time, so each
+-- must give what it would on the object itself.
+
+
+class Point
+{
+  x : Int;
+  y : Int <- 10;
+
+  init(a : Int) : Point { { x <- a; self; } };
+
+  x() : Int { x };
+
+  y() : Int { y };
+
+  move(d : Int) : SELF_TYPE { { x <- x + d; y <- y + d; self; } };
+};
+
+
+class Main inherits IO
+{
+  flag : Bool <- true;
+
+  yes(b : Bool) : Object { if b then out_string("yes ") else out_string("no ") fi };
+
+  main() : Object
+  {
+    {
+      let p : Point <- (new Point).init(1),
+          q : Point <- p,
+          r : Point <- new Point,
+          v : Point
+      in {
+        q.move(2);
+        p.move(3);
+        out_int(p.x()); out_string(" "); out_int(q.y()); out_string("\n");
+        yes(p = q); yes(q = p); yes(p = r); yes(r = q); yes(p = v); yes(v = q);
+        out_string("\n");
+        yes(isvoid p); yes(isvoid q); yes(isvoid r); yes(isvoid v);
+        out_string("\n");
+        let t : Point <- p in let p : Point <- r in
+        {
+          yes(t = q); yes(p = q); yes(p = r);
+          out_int(t.x() + p.x());
+          out_string("\n");
+        };
+      };
+      -- An object that may or may not be another name's is kept.
+      let p : Point <- (new Point).init(4),
+          r : Point <- new Point,
+          s : Point <- if flag then p else r fi
+      in {
+        yes(s = p); yes(s = r); yes(isvoid s);
+        out_int(s.x());
+        out_string("\n");
+      };
+    }
+  };
+};
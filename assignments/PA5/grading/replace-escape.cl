@@ -0,0 +1,59 @@
+-- An object passed to a call that is not inlined is seen outside the
+-- code that made it, so under -O it must still be made: the call and
+-- the code around it must see the same object.
+
+
+class Counter
+{
+  n : Int <- 100;
+
+  get() : Int { n };
+
+  bump() : SELF_TYPE { { n <- n + 1; self; } };
+};
+
+
+class Main inherits IO
+{
+  saved : Counter;
+
+  -- Too big to inline, and it keeps the counter.
+  keep(c : Counter, times : Int) : Counter
+  {
+    {
+      saved <- c;
+      while 0 < times loop { c.bump(); times <- times - 1; } pool;
+      if c.get() < 0 then abort() else 0 fi;
+      c;
+    }
+  };
+
+  -- Recursive, so never inlined.
+  count(c : Counter, times : Int) : Int
+  {
+    if times = 0 then c.get() else count(c.bump(), times - 1) fi
+  };
+
+  main() : Object
+  {
+    {
+      let c : Counter <- new Counter in
+      {
+        c.bump();
+        keep(c, 3);
+        c.bump();
+        out_int(c.get()); out_string(" "); out_int(saved.get()); out_string(" ");
+        out_string(if saved = c then "same\n" else "different\n" fi);
+      };
+      let c : Counter <- new Counter in
+      {
+        out_int(count(c, 5)); out_string(" "); out_int(c.get()); out_string("\n");
+      };
+      let c : Counter <- new Counter, d : Counter <- c.copy() in
+      {
+        d.bump();
+        out_int(c.get()); out_string(" "); out_int(d.get()); out_string("\n");
+      };
+    }
+  };
+};
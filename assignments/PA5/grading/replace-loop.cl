@@ -0,0 +1,67 @@
+-- Under -O an object made once each time a let runs is replaced by its
+-- attributes, and one made again by an assignment in a loop must still
+-- be made each time round.
+
+
+class Counter
+{
+  n : Int <- 10;
+
+  get() : Int { n };
+
+  bump() : SELF_TYPE { { n <- n + 1; self; } };
+};
+
+
+class Main inherits IO
+{
+  main() : Object
+  {
+    let i : Int, total : Int, c : Counter <- new Counter, last : Counter in
+    {
+      -- A new counter each time round, starting from 10.
+      while i < 4 loop
+      {
+        let d : Counter <- new Counter in
+        {
+          d.bump();
+          total <- total + d.get();
+        };
+        i <- i + 1;
+      }
+      pool;
+      out_int(total); out_string("\n");
+
+      -- The counter assigned in the loop replaces the one made before it.
+      i <- 0;
+      total <- 0;
+      while i < 4 loop
+      {
+        c.bump();
+        total <- total + c.get();
+        if i = 1 then { last <- c; c <- new Counter; } else 0 fi;
+        i <- i + 1;
+      }
+      pool;
+      out_int(total); out_string(" "); out_int(c.get()); out_string(" ");
+      out_int(last.get()); out_string("\n");
+
+      -- A let inside the loop body, assigned to a new object there.
+      i <- 0;
+      total <- 0;
+      while i < 3 loop
+      {
+        let e : Counter <- new Counter in
+        {
+          e.bump();
+          e <- new Counter;
+          e.bump().bump();
+          total <- total + e.get();
+        };
+        i <- i + 1;
+      }
+      pool;
+      out_int(total); out_string("\n");
+    }
+  };
+};
@@ -0,0 +1,53 @@
+-- new SELF_TYPE in a method inlined into the code around an object
+-- makes an object of the class of self.  Under -O the receiver must
+-- then be kept, and the new object must have its class.
+
+
+class Cell
+{
+  n : Int <- 1;
+
+  get() : Int { n };
+
+  set(v : Int) : SELF_TYPE { { n <- v; self; } };
+
+  spawn() : SELF_TYPE { (new SELF_TYPE).set(n + 1) };
+
+  name() : String { "cell" };
+};
+
+
+class Special inherits Cell
+{
+  name() : String { "special" };
+};
+
+
+class Main inherits IO
+{
+  main() : Object
+  {
+    {
+      let c : Cell <- new Cell in
+      {
+        c.set(5);
+        let d : Cell <- c.spawn() in
+        {
+          out_int(c.get()); out_string(" "); out_int(d.get()); out_string(" ");
+          out_string(d.name()); out_string(" ");
+          out_string(d.type_name()); out_string("\n");
+        };
+      };
+      let s : Special <- new Special in
+      {
+        let d : Cell <- s.spawn() in
+        {
+          out_int(s.get()); out_string(" "); out_int(d.get()); out_string(" ");
+          out_string(d.name()); out_string(" ");
+          out_string(d.type_name()); out_string("\n");
+        };
+      };
+      out_string((new Special).spawn().spawn().name()); out_string("\n");
+    }
+  };
+};
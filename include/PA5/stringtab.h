@@ -11,6 +11,7 @@
 
 #include <assert.h>
 #include <string.h>
+#include <atomic>
 #include "list.h"    // list template
 #include "cool-io.h"
 
@@ -58,10 +59,12 @@ public:
 // static data definitions.
 //
 // code_def and code_ref are used by the code to produce definitions and
-// references (respectively) to constants.  
+// references (respectively) to constants.  code_ref also marks the
+// constant as referenced; only referenced constants are defined.
 //
 class StringEntry : public Entry {
 public:
+  std::atomic<bool> referenced{false};
   void code_def(ostream& str, int stringclasstag);
   void code_ref(ostream& str);
   StringEntry(char *s, int l, int i);
@@ -74,6 +77,7 @@ public:
 
 class IntEntry: public Entry {
 public:
+  std::atomic<bool> referenced{false};
   void code_def(ostream& str, int intclasstag);
   void code_ref(ostream& str);
   IntEntry(char *s, int l, int i);
@@ -129,12 +133,14 @@ class StrTable : public StringTable<StringEntry>
 {
 public: 
    void code_string_table(ostream&, int classtag);
+   void clear_references();
 };
 
 class IntTable : public StringTable<IntEntry>
 {
 public:
    void code_string_table(ostream&, int classtag);
+   void clear_references();
 };
 
 extern IdTable idtable;
@@ -30,6 +30,12 @@ extern int cool_yydebug;        // for the parser
        bool disable_reg_alloc;  // Don't do register allocation
 
        int cgen_optimize;       // optimize switch for code generator 
+       int cgen_jobs;           // worker threads for per-class code generation
+       bool guard_free;         // rely on inferred types without checking them
+       int cgen_inline_size;    // largest method body inlined, in expressions
+       int cgen_inline_depth;   // levels of calls inlined into inlined code
+       int cgen_int_cache_low;  // least Int preboxed under -O
+       int cgen_int_cache_high; // greatest Int preboxed under -O
        char *out_filename;      // file name for generated code
        Memmgr cgen_Memmgr = GC_NOGC;      // enable/disable garbage collection
        Memmgr_Test cgen_Memmgr_Test = GC_NORMAL;  // normal/test GC
@@ -50,10 +56,16 @@ void handle_flags(int argc, char *argv[]) {
   semant_debug = 0;
   cgen_debug = 0;
   cgen_optimize = 0;
+  cgen_jobs = 1;
   disable_reg_alloc = 0;
+  guard_free = 0;
+  cgen_inline_size = 12;
+  cgen_inline_depth = 3;
+  cgen_int_cache_low = -128;
+  cgen_int_cache_high = 1023;
   
 
-  while ((c = getopt(argc, argv, "lpscvrOo:gtT")) != -1) {
+  while ((c = getopt(argc, argv, "lpscvrOui:b:o:gtTj:")) != -1) {
     switch (c) {
 #ifdef DEBUG
     case 'l':
@@ -99,6 +111,24 @@ void handle_flags(int argc, char *argv[]) {
     case 'O':  // enable optimization
       cgen_optimize = 1;
       break;
+    case 'u':  // trust the types inferred under -O
+      guard_free = 1;
+      break;
+    case 'i':  // inlining budget under -O: size[:depth], 0 disables it
+      if (sscanf(optarg, "%d:%d", &cgen_inline_size, &cgen_inline_depth) < 1 ||
+          cgen_inline_size < 0 || cgen_inline_depth < 0)
+        unknownopt = 1;
+      break;
+    case 'b':  // Ints preboxed under -O: low:high, empty if low > high
+      if (sscanf(optarg, "%d:%d", &cgen_int_cache_low, &cgen_int_cache_high) != 2 ||
+          cgen_int_cache_low < -32767 || cgen_int_cache_high > 32767)
+        unknownopt = 1;
+      break;
+    case 'j':  // generate code for classes in parallel
+      cgen_jobs = atoi(optarg);
+      if (cgen_jobs < 1)
+        unknownopt = 1;
+      break;
     case '?':
       unknownopt = 1;
       break;
@@ -111,9 +141,9 @@ void handle_flags(int argc, char *argv[]) {
   if (unknownopt) {
       cerr << "usage: " << argv[0] << 
 #ifdef DEBUG
-	  " [-lvpscOgtTr -o outname] [input-files]\n";
+	  " [-lvpscOugtTr -i size[:depth] -b low:high -j jobs -o outname] [input-files]\n";
 #else
-      " [-OgtT -o outname] [input-files]\n";
+      " [-OugtT -i size[:depth] -b low:high -j jobs -o outname] [input-files]\n";
 #endif
       exit(1);
   }